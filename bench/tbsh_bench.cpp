@@ -0,0 +1,456 @@
+// Benchmarks for the shell's hot paths. Every result is printed as one JSON
+// object per line, e.g.
+//
+//   {"bench":"downfind","case":"100000 files","iterations":40,
+//    "ns_per_op":12500000.0,"min_ns":12100000.0,"median_ns":12400000.0,
+//    "allocs_per_op":14.00}
+//
+// so that runs can be stored and compared. Synthetic trees are created below
+// --root on first use and reused afterwards.
+#include "../src/tbsh.h"
+
+#include <limits>
+#include <random>
+#include <regex>
+
+// How many times operator new has been called in this process, counted by
+// the replacement in allocations.cpp.
+size_t heap_allocations();
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+struct Options {
+  fs::path root = "/tmp/tbsh-bench";
+  fs::path tbsh; // the shell binary, next to tbsh_bench
+  std::vector<size_t> sizes = {1000, 100000, 1000000};
+  std::string filter;
+  double min_time = 0.5;
+};
+
+Options options;
+
+std::string json_escape(std::string_view s) {
+  std::string result;
+  for (char c : s) {
+    if (c == '"' || c == '\\') {
+      result += '\\';
+    }
+    result += c;
+  }
+  return result;
+}
+
+bool selected(const std::string &bench) {
+  return options.filter.empty() ||
+         bench.find(options.filter) != std::string::npos;
+}
+
+// Runs `op` until at least options.min_time has passed and five samples
+// exist. Fast operations are timed in batches large enough for the clock.
+// When each op handles `items` things (entries walked, lines run), their
+// rate is reported as items_per_sec too.
+template <typename F>
+void measure(const std::string &bench, const std::string &label, F op,
+             size_t items = 0) {
+  if (!selected(bench)) {
+    return;
+  }
+  auto time_batch = [&](size_t n) {
+    auto start = Clock::now();
+    for (size_t i = 0; i < n; i++) {
+      op();
+    }
+    return std::chrono::duration<double, std::nano>(Clock::now() - start)
+        .count();
+  };
+
+  time_batch(1);
+  size_t batch = 1;
+  while (batch < (1u << 20) && time_batch(batch) < 1e6) {
+    batch *= 2;
+  }
+
+  std::vector<double> samples;
+  samples.reserve(64);
+  double total = 0;
+  size_t allocations = heap_allocations();
+  while (samples.size() < 5 || total < options.min_time * 1e9) {
+    double ns = time_batch(batch);
+    total += ns;
+    samples.push_back(ns / batch);
+  }
+  allocations = heap_allocations() - allocations;
+  std::vector<double> sorted = samples;
+  std::sort(sorted.begin(), sorted.end());
+  double ns_per_op = total / (samples.size() * batch);
+  char line[512];
+  int n = snprintf(line, sizeof(line),
+                   "{\"bench\":\"%s\",\"case\":\"%s\",\"iterations\":%zu,"
+                   "\"ns_per_op\":%.1f,\"min_ns\":%.1f,\"median_ns\":%.1f,"
+                   "\"allocs_per_op\":%.2f",
+                   json_escape(bench).c_str(), json_escape(label).c_str(),
+                   samples.size() * batch, ns_per_op, sorted.front(),
+                   sorted[sorted.size() / 2],
+                   double(allocations) / (samples.size() * batch));
+  if (items && n > 0 && size_t(n) < sizeof(line)) {
+    snprintf(line + n, sizeof(line) - n, ",\"items_per_sec\":%.0f",
+             items * 1e9 / ns_per_op);
+  }
+  std::cout << line << "}" << std::endl;
+}
+
+// A tree of `files` empty files, a hundred per directory and ten
+// directories per parent: t<files>/a<k / 1000>/b<k / 100 % 10>/f<k>.txt.
+fs::path synthetic_tree(size_t files) {
+  fs::path top = options.root / ("t" + std::to_string(files));
+  fs::path marker = top / ".complete";
+  if (fs::exists(marker)) {
+    return top;
+  }
+  std::cerr << "creating " << files << " files in " << top << std::endl;
+  fs::remove_all(top);
+  for (size_t k = 0; k < files; k++) {
+    fs::path dir = top / ("a" + std::to_string(k / 1000)) /
+                   ("b" + std::to_string(k / 100 % 10));
+    if (k % 100 == 0) {
+      fs::create_directories(dir);
+    }
+    std::string file = (dir / ("f" + std::to_string(k) + ".txt")).string();
+    int fd = open(file.c_str(), O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0) {
+      throw std::runtime_error("cannot create " + file);
+    }
+    close(fd);
+  }
+  std::ofstream{marker};
+  return top;
+}
+
+// A directory `depth` levels below the one holding `marker`, the root.
+fs::path deep_chain(size_t depth) {
+  fs::create_directories(options.root / "marker");
+  fs::path dir = options.root;
+  for (size_t i = 0; i < depth; i++) {
+    dir /= "l" + std::to_string(i);
+  }
+  fs::create_directories(dir);
+  return dir;
+}
+
+void bench_upfind(Shell &shell) {
+  for (size_t depth : {1, 8, 32}) {
+    fs::path start = deep_chain(depth);
+    measure("upfind", std::to_string(depth) + " levels",
+            [&] { shell.upfind("marker", start); });
+  }
+  // Each line starts a new epoch, so every level is revalidated: what the
+  // backends differ in.
+  if (!selected("upfind")) {
+    return;
+  }
+  for (auto [label, backend] :
+       {std::pair{"serial", Shell::UpfindBackend::Serial},
+        std::pair{"io_uring", Shell::UpfindBackend::IoUring},
+        std::pair{"threads", Shell::UpfindBackend::Threads}}) {
+    shell.upfind_backend = backend;
+    for (size_t depth : {1, 8, 32}) {
+      shell.change_directory(deep_chain(depth).c_str(), false);
+      measure("upfind",
+              std::to_string(depth) + " levels, new line, " + label,
+              [&] { shell.transform_command("cd <marker"); });
+    }
+  }
+  shell.upfind_backend = Shell::UpfindBackend::Auto;
+}
+
+// Every file and directory below `top`, as a walk of it counts them.
+size_t tree_entries(const fs::path &top) {
+  size_t entries = 0;
+  for (auto it = fs::recursive_directory_iterator(top);
+       it != fs::recursive_directory_iterator(); ++it) {
+    entries++;
+  }
+  return entries;
+}
+
+void bench_downfind(Shell &shell) {
+  const size_t unlimited = std::numeric_limits<size_t>::max();
+  if (!selected("downfind") && !selected("parallel_downfind")) {
+    return;
+  }
+  for (size_t files : options.sizes) {
+    fs::path tree = synthetic_tree(files);
+    std::string label = std::to_string(files) + " files";
+    size_t entries = tree_entries(tree);
+    // A pattern nothing matches makes every run walk the whole tree.
+    measure(
+        "downfind", label,
+        [&] {
+          try {
+            shell.downfind("missing.txt", tree, unlimited);
+          } catch (const std::exception &) {
+          }
+        },
+        entries);
+    shell.downfind_threads = std::max(2u, std::thread::hardware_concurrency());
+    measure(
+        "parallel_downfind", label,
+        [&] {
+          try {
+            shell.parallel_downfind("missing.txt", tree, unlimited);
+          } catch (const std::exception &) {
+          }
+        },
+        entries);
+    shell.downfind_threads = 1;
+  }
+}
+
+// Lines are resolved from the top of the 1k-file tree, one level below
+// `marker`.
+void bench_transform(Shell &shell) {
+  if (!selected("transform_command")) {
+    return;
+  }
+  fs::path tree = synthetic_tree(1000);
+  deep_chain(0);
+  const std::pair<const char *, std::string> lines[] = {
+      {"no sigils", "ls -la src | grep main > out.txt"},
+      {"upfind", "cd <marker"},
+      {"downfind 1k", "cat >f999.txt"},
+      {"mixed", "cp >f999.txt <marker"},
+  };
+  shell.change_directory(tree.c_str(), false);
+  for (const auto &[label, line] : lines) {
+    measure("transform_command", label,
+            [&] { shell.transform_command(line); });
+  }
+}
+
+// The tokens of `line` by the std::regex transform_command used before
+// SigilScanner, as (offset, direction, path).
+using Sigils = std::vector<std::tuple<size_t, char, std::string>>;
+
+const char *const sigil_regex = R"((<|>)([a-zA-Z0-9_.\-\/]+))";
+
+Sigils regex_sigils(const std::string &line, const std::regex &pattern) {
+  Sigils sigils;
+  for (std::sregex_iterator it(line.begin(), line.end(), pattern), end;
+       it != end; ++it) {
+    sigils.emplace_back(it->position(), (*it)[1].str()[0], (*it)[2].str());
+  }
+  return sigils;
+}
+
+Sigils scanner_sigils(const std::string &line) {
+  Sigils sigils;
+  SigilScanner scanner(line);
+  while (auto token = scanner.next()) {
+    sigils.emplace_back(token->pos, token->direction,
+                        std::string(token->path));
+  }
+  return sigils;
+}
+
+// SigilScanner against the regex it replaced, which transform_command
+// compiled for every line. Random lines without quotes or backslashes,
+// which the scanner deliberately treats differently, must give the same
+// tokens. Returns false if any does not.
+bool bench_sigils() {
+  if (!selected("sigils")) {
+    return true;
+  }
+  const std::regex pattern(sigil_regex);
+  std::mt19937 rng(42);
+  const std::string alphabet = "ab.-/_09 <>|&;=";
+  size_t mismatches = 0, checked = 20000;
+  for (size_t i = 0; i < checked; i++) {
+    std::string line(rng() % 40, ' ');
+    for (char &c : line) {
+      c = alphabet[rng() % alphabet.size()];
+    }
+    if (regex_sigils(line, pattern) != scanner_sigils(line)) {
+      if (mismatches++ < 5) {
+        std::cerr << "sigils: scanner and regex differ on '" << line << "'"
+                  << std::endl;
+      }
+    }
+  }
+  std::cout << "{\"bench\":\"sigils\",\"case\":\"regex equivalence\","
+               "\"lines\":"
+            << checked << ",\"mismatches\":" << mismatches << "}"
+            << std::endl;
+
+  const std::pair<const char *, std::string> lines[] = {
+      {"no sigils", "ls -la src | grep main > out.txt"},
+      {"mixed", "cp >f999.txt <marker"},
+      {"long line", "make -C <build >src/main.cpp >src/tbsh.h CXXFLAGS=-O2 "
+                    "-j8 2>&1 | tee >logs/build.log"},
+  };
+  for (const auto &[label, line] : lines) {
+    measure("sigils", std::string("regex, ") + label, [&] {
+      std::regex compiled(sigil_regex);
+      regex_sigils(line, compiled);
+    });
+    measure("sigils", std::string("scanner, ") + label, [&] {
+      SigilScanner scanner(line);
+      while (scanner.next()) {
+      }
+    });
+  }
+  return mismatches == 0;
+}
+
+void bench_tokenize() {
+  const std::pair<const char *, const char *> lines[] = {
+      {"simple", "ls -la /usr/lib"},
+      {"pipeline",
+       "cat access.log | grep -v healthz | sort | uniq -c | sort -rn > top"},
+      {"quoted", "echo 'single quoted' \"double $HOME\" back\\ slash >> log &"},
+  };
+  CommandLine command_line;
+  for (const auto &[label, line] : lines) {
+    measure("tokenize", label, [&] { command_line.parse(line); });
+  }
+}
+
+// Whole lines through Shell::execute, with a builtin that does nothing, so
+// that what is left is the shell's own per-line work. In steady state a
+// batch shell's line should not allocate; an interactive shell also copies
+// each new line for the history.
+void bench_execute(Shell &shell) {
+  shell.add_custom_command(":", [](std::vector<std::string_view> &) {});
+  const std::pair<const char *, const char *> lines[] = {
+      {"builtin", ": -la /usr/lib"},
+      {"long line", ": one two three four five six seven eight nine ten "
+                    "eleven twelve thirteen fourteen fifteen sixteen"},
+      {"quoted", ": 'single quoted' \"double $HOME\" back\\ slash"},
+  };
+  for (const auto &[label, line] : lines) {
+    measure("execute", label, [&] { shell.execute(line); });
+  }
+}
+
+// Runs options.tbsh over `script` and waits for it: as a script argument,
+// in batch mode, or as its standard input, which takes the readline path.
+// Whatever it keeps as state goes below options.root.
+void run_tbsh(const fs::path &script, bool batch) {
+  std::cout.flush();
+  pid_t pid = fork();
+  if (pid == 0) {
+    int null_fd = open("/dev/null", O_WRONLY);
+    dup2(null_fd, STDOUT_FILENO);
+    if (!batch) {
+      int in_fd = open(script.c_str(), O_RDONLY);
+      dup2(in_fd, STDIN_FILENO);
+    }
+    setenv("XDG_STATE_HOME", (options.root / "state").c_str(), 1);
+    execl(options.tbsh.c_str(), "tbsh", batch ? script.c_str() : nullptr,
+          nullptr);
+    _exit(127);
+  }
+  int status;
+  while (pid > 0 && waitpid(pid, &status, 0) < 0 && errno == EINTR) {
+  }
+}
+
+// Lines per second through a whole tbsh process, batch mode against the
+// interactive path, over a script of in-process builtins so that neither
+// waits on a child.
+void bench_script() {
+  if (!selected("script")) {
+    return;
+  }
+  if (!fs::exists(options.tbsh)) {
+    std::cerr << "script: no " << options.tbsh << ", skipped" << std::endl;
+    return;
+  }
+  const size_t lines = 2000;
+  fs::path script = options.root / "lines.tbsh";
+  {
+    std::ofstream out(script, std::ios::trunc);
+    for (size_t i = 0; i < lines; i++) {
+      out << (i % 3 == 0   ? "echo line " + std::to_string(i)
+              : i % 3 == 1 ? std::string("pwd")
+                           : std::string("test -d /tmp"))
+          << "\n";
+    }
+  }
+  std::string label = std::to_string(lines) + " lines";
+  measure(
+      "script", "batch, " + label, [&] { run_tbsh(script, true); }, lines);
+  measure(
+      "script", "interactive path, " + label,
+      [&] { run_tbsh(script, false); }, lines);
+}
+
+void bench_launch(Shell &shell) {
+  char true_path[] = "/bin/true";
+  char *argv[] = {true_path, nullptr};
+  for (auto [label, backend] :
+       {std::pair{"posix_spawn", Shell::LaunchBackend::Spawn},
+        std::pair{"fork", Shell::LaunchBackend::Fork}}) {
+    shell.launch_backend = backend;
+    measure("launch", label, [&] {
+      pid_t pid = shell.launch(argv);
+      int status;
+      while (pid > 0 && waitpid(pid, &status, 0) < 0 && errno == EINTR) {
+      }
+    });
+  }
+  shell.launch_backend = Shell::LaunchBackend::Spawn;
+}
+
+std::vector<size_t> parse_sizes(const std::string &list) {
+  std::vector<size_t> sizes;
+  size_t pos = 0;
+  while (pos < list.size()) {
+    size_t comma = list.find(',', pos);
+    if (comma == std::string::npos) {
+      comma = list.size();
+    }
+    sizes.push_back(std::stoul(list.substr(pos, comma - pos)));
+    pos = comma + 1;
+  }
+  return sizes;
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+  for (int i = 1; i < argc; i++) {
+    std::string arg = argv[i];
+    if (arg == "--root" && i + 1 < argc) {
+      options.root = argv[++i];
+    } else if (arg == "--sizes" && i + 1 < argc) {
+      options.sizes = parse_sizes(argv[++i]);
+    } else if (arg == "--filter" && i + 1 < argc) {
+      options.filter = argv[++i];
+    } else if (arg == "--min-time" && i + 1 < argc) {
+      options.min_time = std::stod(argv[++i]);
+    } else {
+      std::cerr << "Usage: " << argv[0]
+                << " [--root dir] [--sizes n,n,...] [--filter bench]"
+                   " [--min-time seconds]"
+                << std::endl;
+      return EXIT_FAILURE;
+    }
+  }
+
+  options.tbsh = fs::absolute(argv[0]).parent_path() / "tbsh";
+  fs::create_directories(options.root);
+
+  Shell shell(true);
+  register_builtins(shell);
+  bench_upfind(shell);
+  bench_downfind(shell);
+  bench_transform(shell);
+  bool sigils_agree = bench_sigils();
+  bench_tokenize();
+  bench_execute(shell);
+  bench_launch(shell);
+  bench_script();
+  return sigils_agree ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -1,2 +1,29 @@
 #!/bin/bash
-g++ -std=c++17 src/main.cpp -lreadline -o build/tbsh
+# Usage: ./build.sh [tbsh | tbshd | tbsh_bench | all]   (default: tbsh)
+set -e
+CXXFLAGS="-std=c++17 -O2 -pthread"
+mkdir -p build
+
+LIBTBSH="state stats upfind index lookup jobs command_line daemon_client shell
+  builtins fast_builtins"
+objects=()
+for name in $LIBTBSH; do
+  g++ $CXXFLAGS -c src/$name.cpp -o build/$name.o
+  objects+=(build/$name.o)
+done
+rm -f build/libtbsh.a
+ar rcs build/libtbsh.a "${objects[@]}"
+
+target=${1:-tbsh}
+if [ "$target" = tbsh ] || [ "$target" = all ]; then
+  g++ $CXXFLAGS src/main.cpp build/libtbsh.a -lreadline -o build/tbsh
+fi
+if [ "$target" = tbshd ] || [ "$target" = all ]; then
+  g++ $CXXFLAGS src/tbshd.cpp build/libtbsh.a -lreadline -o build/tbshd
+fi
+# Only the bench counts allocations.
+if [ "$target" = tbsh_bench ] || [ "$target" = all ]; then
+  g++ $CXXFLAGS -c src/allocations.cpp -o build/allocations.o
+  g++ $CXXFLAGS bench/tbsh_bench.cpp build/allocations.o build/libtbsh.a \
+    -lreadline -o build/tbsh_bench
+fi
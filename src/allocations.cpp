@@ -0,0 +1,42 @@
+#include "tbsh.h"
+
+// Replaces the global operator new to count calls, so that tbsh_bench can
+// check which paths allocate; only tbsh_bench links it. Of the other forms
+// of new, libstdc++'s defaults reach the plain and the aligned ones, which
+// the std::pmr resources use. Every delete that can free their memory,
+// sized or not, is replaced to match.
+namespace {
+std::atomic<size_t> allocations{0};
+}
+
+void *operator new(size_t size) {
+  allocations.fetch_add(1, std::memory_order_relaxed);
+  if (void *p = std::malloc(size ? size : 1)) {
+    return p;
+  }
+  throw std::bad_alloc();
+}
+
+void operator delete(void *p) noexcept { std::free(p); }
+
+void operator delete(void *p, size_t) noexcept { std::free(p); }
+
+void *operator new(size_t size, std::align_val_t alignment) {
+  allocations.fetch_add(1, std::memory_order_relaxed);
+  void *p;
+  if (posix_memalign(&p, std::max(size_t(alignment), sizeof(void *)),
+                     size ? size : 1) == 0) {
+    return p;
+  }
+  throw std::bad_alloc();
+}
+
+void operator delete(void *p, std::align_val_t) noexcept { std::free(p); }
+
+void operator delete(void *p, size_t, std::align_val_t) noexcept {
+  std::free(p);
+}
+
+size_t heap_allocations() {
+  return allocations.load(std::memory_order_relaxed);
+}
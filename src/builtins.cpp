@@ -0,0 +1,116 @@
+#include "tbsh.h"
+
+void register_builtins(Shell &shell) {
+  shell.add_custom_command("bk", [&](std::vector<std::string_view> &) {
+    auto prev = shell.dir_history.back();
+    if (!prev) {
+      std::cerr << "Cannot go back: No previous directory in history"
+                << std::endl;
+    } else if (std::string dir(*prev);
+               shell.change_directory(dir.c_str(), false)) {
+      std::cout << "Navigated back to: " << dir << std::endl;
+    } else {
+      std::cerr << "Failed to navigate back" << std::endl;
+    }
+  });
+
+  shell.add_custom_command("fw", [&](std::vector<std::string_view> &) {
+    auto next = shell.dir_history.forward();
+    if (!next) {
+      std::cerr << "Cannot go forward: No next directory in history"
+                << std::endl;
+    } else if (std::string dir(*next);
+               shell.change_directory(dir.c_str(), false)) {
+      std::cout << "Navigated forward to: " << dir << std::endl;
+    } else {
+      std::cerr << "Failed to navigate forward" << std::endl;
+    }
+  });
+
+  shell.add_custom_command("z", [&](std::vector<std::string_view> &args) {
+    std::vector<std::string_view> terms(args.begin() + 1, args.end());
+    if (terms.empty()) {
+      for (const auto &[path, visits] : shell.dir_history.top(10)) {
+        char weight[32];
+        snprintf(weight, sizeof(weight), "%8.1f", visits);
+        std::cout << weight << "  " << path << std::endl;
+      }
+      return;
+    }
+    auto target = shell.dir_history.best(terms, shell.current_directory());
+    if (!target) {
+      std::cerr << "z: no match" << std::endl;
+      return;
+    }
+    if (shell.change_directory(target->c_str())) {
+      std::cout << "Jumped to: " << *target << std::endl;
+    }
+  });
+
+  shell.add_custom_command("reindex", [&](std::vector<std::string_view> &) {
+    shell.reindex(shell.current_directory());
+    std::cout << "Index rebuilt" << std::endl;
+  });
+
+  shell.add_custom_command("hash", [&](std::vector<std::string_view> &args) {
+    if (args.size() == 1) {
+      shell.path_cache.print(std::cout);
+      return;
+    }
+    if (args[1] == "-r") {
+      shell.path_cache.clear();
+      return;
+    }
+    bool forget = args[1] == "-d";
+    for (size_t i = forget ? 2 : 1; i < args.size(); i++) {
+      std::string name(args[i]);
+      if (forget) {
+        shell.path_cache.forget(name);
+      } else if (!shell.path_cache.lookup(name)) {
+        throw std::runtime_error("hash: " + name + ": not found");
+      }
+    }
+  });
+
+  // `stats [on | off | reset | dump FILE [SECONDS]]`
+  shell.add_custom_command("stats", [&](std::vector<std::string_view> &args) {
+    if (args.size() == 1) {
+      global_stats.report(std::cout);
+    } else if (args[1] == "on" || args[1] == "off") {
+      global_stats.enable(args[1] == "on");
+    } else if (args[1] == "reset") {
+      global_stats.reset();
+    } else if (args[1] == "dump" && args.size() > 2) {
+      int seconds = args.size() > 3 ? std::atoi(std::string(args[3]).c_str())
+                                    : 60;
+      global_stats.enable(true);
+      global_stats.dump_to(std::string(args[2]),
+                           std::chrono::seconds(std::max(seconds, 1)));
+    } else {
+      throw std::runtime_error(
+          "usage: stats [on | off | reset | dump FILE [SECONDS]]");
+    }
+  });
+
+  shell.add_custom_command("jobs", [&](std::vector<std::string_view> &) {
+    shell.reap_jobs();
+    shell.jobs.report(std::cout, false);
+  });
+
+  shell.add_custom_command("fg", [&](std::vector<std::string_view> &args) {
+    shell.foreground_job(args.size() > 1 ? args[1] : std::string_view());
+  });
+
+  shell.add_custom_command("bg", [&](std::vector<std::string_view> &args) {
+    shell.background_job(args.size() > 1 ? args[1] : std::string_view());
+  });
+
+  shell.add_custom_command("wait", [&](std::vector<std::string_view> &args) {
+    shell.wait_jobs(args.size() > 1 ? args[1] : std::string_view());
+  });
+
+  shell.add_custom_command("par", [&](std::vector<std::string_view> &args) {
+    shell.path_cache.refresh();
+    shell.run_parallel(args);
+  });
+}
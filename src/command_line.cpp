@@ -0,0 +1,189 @@
+#include "tbsh.h"
+
+void CommandLine::recycle() {
+  for (Stage &stage : stages) {
+    stage.args.clear();
+    stage.argv.clear();
+    stage.input = stage.output = nullptr;
+    stage.append = false;
+    spare.push_back(std::move(stage));
+  }
+  stages.clear();
+}
+
+void CommandLine::add_stage() {
+  if (spare.empty()) {
+    stages.emplace_back();
+  } else {
+    stages.push_back(std::move(spare.back()));
+    spare.pop_back();
+  }
+}
+
+void CommandLine::parse(std::string_view line) {
+  // Every word is at most as long as the text it came from and is followed
+  // by a blank, an operator or the end of the line, so with one byte more
+  // for the final NUL the arena never outgrows the line.
+  arena.resize(line.size() + 1);
+  recycle();
+  add_stage();
+  background = false;
+
+  enum class Redirect { None, Input, Output, Append };
+  Redirect pending = Redirect::None;
+
+  char *out = arena.data();
+  char *word = nullptr;
+  auto start_word = [&] {
+    if (!word) {
+      word = out;
+    }
+  };
+  auto end_word = [&] {
+    if (!word) {
+      return;
+    }
+    *out++ = '\0';
+    Stage &stage = stages.back();
+    switch (pending) {
+    case Redirect::None:
+      stage.args.emplace_back(word, out - word - 1);
+      stage.argv.push_back(word);
+      break;
+    case Redirect::Input:
+      stage.input = word;
+      break;
+    case Redirect::Output:
+    case Redirect::Append:
+      stage.output = word;
+      stage.append = pending == Redirect::Append;
+      break;
+    }
+    pending = Redirect::None;
+    word = nullptr;
+  };
+  auto end_stage = [&](const char *token) {
+    if (pending != Redirect::None || stages.back().args.empty()) {
+      throw std::runtime_error(
+          std::string("syntax error near unexpected token `") + token + "'");
+    }
+    stages.back().argv.push_back(nullptr);
+  };
+  auto is_blank = [&](size_t i) {
+    return i >= line.size() || line[i] == ' ' || line[i] == '\t' ||
+           line[i] == '\n';
+  };
+
+  for (size_t i = 0; i < line.size(); i++) {
+    char c = line[i];
+    if (c == ' ' || c == '\t' || c == '\n') {
+      end_word();
+    } else if (c == '|') {
+      end_word();
+      end_stage("|");
+      add_stage();
+    } else if (c == '&') {
+      end_word();
+      if (line.find_first_not_of(" \t\n", i + 1) != std::string_view::npos) {
+        throw std::runtime_error("syntax error near unexpected token `&'");
+      }
+      end_stage("&");
+      background = true;
+      return;
+    } else if ((c == '<' || c == '>') && !word) {
+      bool append = c == '>' && i + 1 < line.size() && line[i + 1] == '>';
+      size_t end = i + (append ? 2 : 1);
+      if (!is_blank(end)) {
+        start_word();
+        *out++ = c;
+        continue;
+      }
+      if (pending != Redirect::None) {
+        throw std::runtime_error(
+            std::string("syntax error near unexpected token `") +
+            (append ? ">>" : c == '<' ? "<" : ">") + "'");
+      }
+      pending = c == '<' ? Redirect::Input
+                : append ? Redirect::Append
+                         : Redirect::Output;
+      i = end - 1;
+    } else if (c == '\\') {
+      start_word();
+      if (++i < line.size() && line[i] != '\n') {
+        *out++ = line[i];
+      }
+    } else if (c == '\'') {
+      start_word();
+      size_t close = line.find('\'', i + 1);
+      if (close == std::string_view::npos) {
+        throw std::runtime_error("Unterminated single quote");
+      }
+      out = std::copy(line.begin() + i + 1, line.begin() + close, out);
+      i = close;
+    } else if (c == '"') {
+      start_word();
+      for (i++; i < line.size() && line[i] != '"'; i++) {
+        if (line[i] == '\\' && i + 1 < line.size() &&
+            std::strchr("$`\"\\\n", line[i + 1])) {
+          if (line[++i] == '\n') {
+            continue;
+          }
+        }
+        *out++ = line[i];
+      }
+      if (i == line.size()) {
+        throw std::runtime_error("Unterminated double quote");
+      }
+    } else {
+      start_word();
+      *out++ = c;
+    }
+  }
+  end_word();
+
+  if (stages.size() == 1 && stages[0].args.empty() &&
+      pending == Redirect::None && !stages[0].redirected()) {
+    recycle();
+    return;
+  }
+  end_stage("newline");
+}
+
+bool LineReader::next(std::string_view &line) {
+  while (true) {
+    char *start = buffer.data() + begin;
+    char *newline =
+        static_cast<char *>(std::memchr(start, '\n', end - begin));
+    if (newline) {
+      line = std::string_view(start, newline - start);
+      begin += line.size() + 1;
+      return true;
+    }
+    if (eof) {
+      if (begin == end) {
+        return false;
+      }
+      line = std::string_view(start, end - begin);
+      begin = end;
+      return true;
+    }
+
+    // Keep the partial line and refill behind it, growing only for lines
+    // longer than the buffer.
+    std::memmove(buffer.data(), start, end - begin);
+    end -= begin;
+    begin = 0;
+    if (end == buffer.size()) {
+      buffer.resize(buffer.size() * 2);
+    }
+    ssize_t n = read(fd, buffer.data() + end, buffer.size() - end);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      eof = true;
+    } else {
+      end += n;
+    }
+  }
+}
@@ -0,0 +1,144 @@
+#include "tbsh.h"
+
+void DaemonClient::disconnect() {
+  if (fd >= 0) {
+    close(fd);
+  }
+  fd = -1;
+  buffer.clear();
+  retry_at = std::chrono::steady_clock::now() + retry_delay;
+}
+
+bool DaemonClient::connect_locked() {
+  if (fd >= 0) {
+    return true;
+  }
+  if (std::chrono::steady_clock::now() < retry_at) {
+    return false;
+  }
+  struct sockaddr_un addr {};
+  addr.sun_family = AF_UNIX;
+  if (socket_path.size() >= sizeof(addr.sun_path)) {
+    return false;
+  }
+  std::memcpy(addr.sun_path, socket_path.c_str(), socket_path.size() + 1);
+  fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd < 0 ||
+      connect(fd, reinterpret_cast<struct sockaddr *>(&addr),
+              sizeof(addr)) != 0) {
+    disconnect();
+    return false;
+  }
+  // Only trust a daemon run by the same user.
+  struct ucred peer;
+  socklen_t length = sizeof(peer);
+  if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &peer, &length) != 0 ||
+      peer.uid != getuid()) {
+    disconnect();
+    return false;
+  }
+  return true;
+}
+
+bool DaemonClient::send_locked(const std::string &request) {
+  for (size_t done = 0; done < request.size();) {
+    ssize_t n = send(fd, request.data() + done, request.size() - done,
+                     MSG_NOSIGNAL);
+    if (n <= 0) {
+      disconnect();
+      return false;
+    }
+    done += n;
+  }
+  return true;
+}
+
+std::optional<std::vector<std::string>> DaemonClient::reply_locked() {
+  size_t newline;
+  while ((newline = buffer.find('\n')) == std::string::npos) {
+    struct pollfd pfd = {fd, POLLIN, 0};
+    char chunk[4096];
+    ssize_t n = poll(&pfd, 1, reply_timeout_ms) == 1
+                    ? read(fd, chunk, sizeof(chunk))
+                    : -1;
+    if (n <= 0) {
+      disconnect();
+      return std::nullopt;
+    }
+    buffer.append(chunk, n);
+  }
+  std::vector<std::string> fields;
+  size_t start = 0;
+  for (size_t tab; (tab = buffer.find('\t', start)) < newline;
+       start = tab + 1) {
+    fields.push_back(buffer.substr(start, tab - start));
+  }
+  fields.push_back(buffer.substr(start, newline - start));
+  buffer.erase(0, newline + 1);
+  return fields;
+}
+
+bool DaemonClient::sendable(const std::string &s) {
+  return s.find_first_of("\t\n") == std::string::npos;
+}
+
+DaemonClient::~DaemonClient() {
+  if (fd >= 0) {
+    close(fd);
+  }
+}
+
+std::string DaemonClient::default_path() {
+  const char *runtime = getenv("XDG_RUNTIME_DIR");
+  if (runtime && *runtime) {
+    return std::string(runtime) + "/tbshd.sock";
+  }
+  return "/tmp/tbshd-" + std::to_string(getuid()) + ".sock";
+}
+
+bool DaemonClient::resolve(std::vector<Resolution> &batch,
+                           const std::string &dir) {
+  std::string request;
+  for (auto &token : batch) {
+    if (!sendable(token.pattern) || !sendable(dir)) {
+      return false;
+    }
+    request += std::string("resolve\t") + token.direction + "\t" + dir +
+               "\t" + token.pattern + "\n";
+  }
+  std::lock_guard<std::mutex> lock(mutex);
+  if (!connect_locked() || !send_locked(request)) {
+    return false;
+  }
+  for (auto &token : batch) {
+    auto fields = reply_locked();
+    if (!fields || fields->size() < 2) {
+      disconnect();
+      return false;
+    }
+    token.found = (*fields)[0] == "ok";
+    token.text = (*fields)[1];
+  }
+  return true;
+}
+
+std::optional<std::vector<std::string>>
+DaemonClient::complete(const std::string &text, const std::string &dir) {
+  if (!sendable(text) || !sendable(dir)) {
+    return std::nullopt;
+  }
+  std::lock_guard<std::mutex> lock(mutex);
+  if (!connect_locked() || !send_locked("complete\t" + dir + "\t" + text +
+                                        "\n")) {
+    return std::nullopt;
+  }
+  auto fields = reply_locked();
+  if (!fields || fields->empty() || (*fields)[0] != "ok") {
+    return std::nullopt;
+  }
+  fields->erase(fields->begin());
+  if (fields->size() == 1 && fields->front().empty()) {
+    fields->clear();
+  }
+  return fields;
+}
@@ -0,0 +1,519 @@
+#include "tbsh.h"
+
+#include <charconv>
+#include <sys/sendfile.h>
+
+// In-process versions of the external commands scripts run most. Each one
+// handles the common forms and leaves any option it does not know to the
+// real command, so that nothing behaves differently, only faster.
+namespace {
+
+using Args = std::vector<std::string_view>;
+
+bool write_all(int fd, std::string_view text) {
+  while (!text.empty()) {
+    ssize_t n = write(fd, text.data(), text.size());
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return false;
+    }
+    text.remove_prefix(n);
+  }
+  return true;
+}
+
+void complain(const char *command, std::string_view what, int error) {
+  std::cerr << command << ": " << what << ": " << strerror(error)
+            << std::endl;
+}
+
+// pwd [-L | -P]. Physical by default, as coreutils pwd is when $PWD is not
+// exported, which tbsh never does.
+bool pwd_accepts(const Args &args) {
+  return args.size() == 1 ||
+         (args.size() == 2 && (args[1] == "-L" || args[1] == "-P"));
+}
+
+int pwd(Shell &shell, const Args &args) {
+  std::string dir = shell.current_directory();
+  if (args.size() == 1 || args[1] == "-P") {
+    std::error_code ec;
+    fs::path real = fs::canonical(dir, ec);
+    if (!ec) {
+      dir = real.string();
+    }
+  }
+  dir += '\n';
+  return write_all(STDOUT_FILENO, dir) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+// echo [-n] [args...]. Like coreutils echo, only leading arguments made up
+// of n, e and E count as options; -e and -E are left to it.
+bool echo_option(std::string_view arg) {
+  return arg.size() > 1 && arg[0] == '-' &&
+         arg.find_first_not_of("neE", 1) == std::string_view::npos;
+}
+
+bool echo_accepts(const Args &args) {
+  for (size_t i = 1; i < args.size() && echo_option(args[i]); i++) {
+    if (args[i].find_first_of("eE") != std::string_view::npos) {
+      return false;
+    }
+  }
+  return !(args.size() == 2 && (args[1] == "--help" || args[1] == "--version"));
+}
+
+int echo(const Args &args) {
+  size_t i = 1;
+  bool newline = true;
+  for (; i < args.size() && echo_option(args[i]); i++) {
+    newline = false;
+  }
+  std::string text;
+  for (size_t first = i; i < args.size(); i++) {
+    if (i > first) {
+      text += ' ';
+    }
+    text += args[i];
+  }
+  if (newline) {
+    text += '\n';
+  }
+  return write_all(STDOUT_FILENO, text) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+// cat [-u] [file...], with `-` or no files for standard input. Only regular
+// files are read in-process; a terminal, a FIFO or a device such as
+// /dev/zero may never end, and is left to the external cat, which ^C can
+// interrupt.
+bool is_regular(const char *path) {
+  struct stat st;
+  return stat(path, &st) == 0 && S_ISREG(st.st_mode);
+}
+
+bool cat_accepts(const Args &args) {
+  bool files = false, dash = false;
+  for (size_t i = 1; i < args.size(); i++) {
+    if (args[i] == "-") {
+      dash = true;
+    } else if (args[i].size() > 1 && args[i][0] == '-' && args[i] != "-u") {
+      return false;
+    } else if (args[i] != "-u") {
+      if (!is_regular(std::string(args[i]).c_str())) {
+        return false;
+      }
+      files = true;
+    }
+  }
+  struct stat in;
+  return (files && !dash) ||
+         (fstat(STDIN_FILENO, &in) == 0 && S_ISREG(in.st_mode));
+}
+
+// Copies `in` to `out` inside the kernel where it can: copy_file_range
+// between files, sendfile from a file to anything else, and read/write for
+// pipes, terminals and files like those in /proc that report no size.
+bool copy_fd(int in, int out) {
+  struct stat st;
+  if (fstat(in, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+    bool ranged = true;
+    while (true) {
+      ssize_t n = ranged ? copy_file_range(in, nullptr, out, nullptr,
+                                           1 << 30, 0)
+                         : sendfile(out, in, nullptr, 1 << 30);
+      if (n == 0) {
+        return true;
+      }
+      if (n > 0 || errno == EINTR) {
+        continue;
+      }
+      // An O_APPEND output makes copy_file_range fail with EBADF.
+      if (errno != EXDEV && errno != EINVAL && errno != ENOSYS &&
+          errno != EOPNOTSUPP && errno != EBADF) {
+        return false;
+      }
+      if (!ranged) {
+        break;
+      }
+      ranged = false;
+    }
+  }
+
+  char buffer[128 * 1024];
+  while (true) {
+    ssize_t n = read(in, buffer, sizeof(buffer));
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return n == 0;
+    }
+    if (!write_all(out, std::string_view(buffer, n))) {
+      return false;
+    }
+  }
+}
+
+int cat(const Args &args) {
+  std::vector<std::string_view> files;
+  for (size_t i = 1; i < args.size(); i++) {
+    if (args[i] != "-u") {
+      files.push_back(args[i]);
+    }
+  }
+  if (files.empty()) {
+    files.push_back("-");
+  }
+
+  struct stat out;
+  bool out_regular = fstat(STDOUT_FILENO, &out) == 0 && S_ISREG(out.st_mode);
+  int status = EXIT_SUCCESS;
+  for (std::string_view file : files) {
+    int fd = file == "-" ? STDIN_FILENO
+                         : ::open(std::string(file).c_str(),
+                                  O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+      complain("cat", file, errno);
+      status = EXIT_FAILURE;
+      continue;
+    }
+    struct stat in;
+    if (out_regular && fstat(fd, &in) == 0 && in.st_dev == out.st_dev &&
+        in.st_ino == out.st_ino) {
+      std::cerr << "cat: " << file << ": input file is output file"
+                << std::endl;
+      status = EXIT_FAILURE;
+    } else if (!copy_fd(fd, STDOUT_FILENO)) {
+      complain("cat", file, errno);
+      status = EXIT_FAILURE;
+    }
+    if (fd != STDIN_FILENO) {
+      close(fd);
+    }
+  }
+  return status;
+}
+
+// ls [-1aA] [file...], only where coreutils ls would print one name per
+// line without quoting (output that is not a terminal) and sort bytewise
+// (the C locale).
+bool sorts_bytewise() {
+  for (const char *var : {"LC_ALL", "LC_COLLATE", "LANG"}) {
+    const char *value = getenv(var);
+    if (value && *value) {
+      return std::strcmp(value, "C") == 0 || std::strcmp(value, "POSIX") == 0 ||
+             std::strncmp(value, "C.", 2) == 0;
+    }
+  }
+  return true;
+}
+
+bool ls_accepts(const Args &args) {
+  if (isatty(STDOUT_FILENO) || !sorts_bytewise()) {
+    return false;
+  }
+  return std::all_of(args.begin() + 1, args.end(), [](std::string_view arg) {
+    return arg.size() < 2 || arg[0] != '-' ||
+           arg.find_first_not_of("1aA", 1) == std::string_view::npos;
+  });
+}
+
+// Appends the names in `dir`, sorted, one per line.
+bool list_directory(const std::string &dir, bool all, bool almost_all,
+                    std::string &out) {
+  int fd = ::open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (fd < 0) {
+    return false;
+  }
+  std::vector<std::string> names;
+  alignas(linux_dirent64) char buffer[32 * 1024];
+  long len;
+  while ((len = syscall(SYS_getdents64, fd, buffer, sizeof(buffer))) > 0) {
+    for (long pos = 0; pos < len;) {
+      auto *entry = reinterpret_cast<linux_dirent64 *>(buffer + pos);
+      pos += entry->d_reclen;
+      const char *name = entry->d_name;
+      bool dot_or_dotdot =
+          name[0] == '.' &&
+          (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'));
+      if (name[0] == '.' && !all && (!almost_all || dot_or_dotdot)) {
+        continue;
+      }
+      names.emplace_back(name);
+    }
+  }
+  int error = errno;
+  close(fd);
+  if (len < 0) {
+    errno = error;
+    return false;
+  }
+  std::sort(names.begin(), names.end());
+  for (const std::string &name : names) {
+    out += name;
+    out += '\n';
+  }
+  return true;
+}
+
+int ls(const Args &args) {
+  bool all = false, almost_all = false;
+  std::vector<std::string> operands;
+  for (size_t i = 1; i < args.size(); i++) {
+    std::string_view arg = args[i];
+    if (arg.size() > 1 && arg[0] == '-') {
+      // As in coreutils, the later of -a and -A wins.
+      for (char c : arg.substr(1)) {
+        if (c == 'a' || c == 'A') {
+          all = c == 'a';
+          almost_all = c == 'A';
+        }
+      }
+    } else {
+      operands.emplace_back(arg);
+    }
+  }
+  size_t count = operands.empty() ? 1 : operands.size();
+  if (operands.empty()) {
+    operands.push_back(".");
+  }
+
+  int status = EXIT_SUCCESS;
+  std::vector<std::string> files, dirs;
+  for (std::string &operand : operands) {
+    struct stat st;
+    if (stat(operand.c_str(), &st) != 0 &&
+        lstat(operand.c_str(), &st) != 0) {
+      std::cerr << "ls: cannot access '" << operand
+                << "': " << strerror(errno) << std::endl;
+      status = 2;
+    } else {
+      (S_ISDIR(st.st_mode) ? dirs : files).push_back(std::move(operand));
+    }
+  }
+  std::sort(files.begin(), files.end());
+  std::sort(dirs.begin(), dirs.end());
+
+  std::string out;
+  for (const std::string &file : files) {
+    out += file;
+    out += '\n';
+  }
+  for (const std::string &dir : dirs) {
+    std::string listing = count > 1 ? dir + ":\n" : "";
+    if (!list_directory(dir, all, almost_all, listing)) {
+      std::cerr << "ls: cannot open directory '" << dir
+                << "': " << strerror(errno) << std::endl;
+      status = 2;
+      continue;
+    }
+    if (!out.empty()) {
+      out += '\n';
+    }
+    out += listing;
+  }
+  if (!write_all(STDOUT_FILENO, out)) {
+    return 2;
+  }
+  return status;
+}
+
+// test and [, for the forms of up to four arguments POSIX defines without
+// -a, -o or parentheses. Returns nothing for anything else, which is left to
+// the external test, errors included.
+std::optional<bool> unary_test(std::string_view op, std::string_view operand) {
+  if (op == "-z") {
+    return operand.empty();
+  }
+  if (op == "-n") {
+    return !operand.empty();
+  }
+  if (op.size() != 2 || op[0] != '-') {
+    return std::nullopt;
+  }
+  std::string path(operand);
+  struct stat st;
+  switch (op[1]) {
+  case 'L':
+  case 'h':
+    return lstat(path.c_str(), &st) == 0 && S_ISLNK(st.st_mode);
+  case 'r':
+    return faccessat(AT_FDCWD, path.c_str(), R_OK, AT_EACCESS) == 0;
+  case 'w':
+    return faccessat(AT_FDCWD, path.c_str(), W_OK, AT_EACCESS) == 0;
+  case 'x':
+    return faccessat(AT_FDCWD, path.c_str(), X_OK, AT_EACCESS) == 0;
+  case 'e':
+  case 'f':
+  case 'd':
+  case 's':
+  case 'p':
+  case 'S':
+  case 'b':
+  case 'c':
+    break;
+  default:
+    return std::nullopt;
+  }
+  if (stat(path.c_str(), &st) != 0) {
+    return false;
+  }
+  switch (op[1]) {
+  case 'f':
+    return S_ISREG(st.st_mode);
+  case 'd':
+    return S_ISDIR(st.st_mode);
+  case 's':
+    return st.st_size > 0;
+  case 'p':
+    return S_ISFIFO(st.st_mode);
+  case 'S':
+    return S_ISSOCK(st.st_mode);
+  case 'b':
+    return S_ISBLK(st.st_mode);
+  case 'c':
+    return S_ISCHR(st.st_mode);
+  default:
+    return true;
+  }
+}
+
+std::optional<long long> integer(std::string_view text) {
+  long long value;
+  const char *begin = text.data() + (!text.empty() && text[0] == '+');
+  auto [end, error] = std::from_chars(begin, text.data() + text.size(), value);
+  if (error != std::errc() || end != text.data() + text.size() ||
+      begin == end) {
+    return std::nullopt;
+  }
+  return value;
+}
+
+std::optional<bool> binary_test(std::string_view left, std::string_view op,
+                                std::string_view right) {
+  if (op == "=" || op == "==") {
+    return left == right;
+  }
+  if (op == "!=") {
+    return left != right;
+  }
+  static const std::pair<const char *, int> comparisons[] = {
+      {"-eq", 0}, {"-ne", 1}, {"-lt", 2}, {"-le", 3}, {"-gt", 4}, {"-ge", 5}};
+  for (auto [name, kind] : comparisons) {
+    if (op != name) {
+      continue;
+    }
+    auto a = integer(left), b = integer(right);
+    if (!a || !b) {
+      return std::nullopt;
+    }
+    bool results[] = {*a == *b, *a != *b, *a < *b,
+                      *a <= *b, *a > *b,  *a >= *b};
+    return results[kind];
+  }
+  return std::nullopt;
+}
+
+bool is_binary_operator(std::string_view op) {
+  for (const char *name :
+       {"=", "==", "!=", "-eq", "-ne", "-lt", "-le", "-gt", "-ge", "-nt",
+        "-ot", "-ef"}) {
+    if (op == name) {
+      return true;
+    }
+  }
+  return false;
+}
+
+std::optional<bool> evaluate(const std::string_view *argv, size_t argc) {
+  auto negate = [](std::optional<bool> result) {
+    return result ? std::optional<bool>(!*result) : std::nullopt;
+  };
+  for (size_t i = 0; i < argc; i++) {
+    if (argv[i] == "-a" || argv[i] == "-o" || argv[i] == "(" ||
+        argv[i] == ")") {
+      return std::nullopt;
+    }
+  }
+  switch (argc) {
+  case 0:
+    return false;
+  case 1:
+    return !argv[0].empty();
+  case 2:
+    if (argv[0] == "!") {
+      return argv[1].empty();
+    }
+    return unary_test(argv[0], argv[1]);
+  case 3:
+    if (is_binary_operator(argv[1])) {
+      return binary_test(argv[0], argv[1], argv[2]);
+    }
+    if (argv[0] == "!") {
+      return negate(evaluate(argv + 1, 2));
+    }
+    return std::nullopt;
+  case 4:
+    if (argv[0] == "!") {
+      return negate(evaluate(argv + 1, 3));
+    }
+    return std::nullopt;
+  default:
+    return std::nullopt;
+  }
+}
+
+std::optional<bool> test(const Args &args) {
+  size_t argc = args.size() - 1;
+  if (args[0] == "[") {
+    if (argc == 0 || args.back() != "]") {
+      return std::nullopt;
+    }
+    argc--;
+  }
+  return evaluate(args.data() + 1, argc);
+}
+
+} // namespace
+
+void register_fast_builtins(Shell &shell) {
+  const char *list = getenv("TBSH_FAST");
+  std::string_view selected = list ? list : "pwd:echo:cat:ls:test";
+  auto wanted = [&](std::string_view name) {
+    for (size_t pos = 0; pos <= selected.size();) {
+      size_t colon = std::min(selected.find(':', pos), selected.size());
+      if (selected.substr(pos, colon - pos) == name) {
+        return true;
+      }
+      pos = colon + 1;
+    }
+    return false;
+  };
+
+  if (wanted("pwd")) {
+    shell.add_fast_command(
+        "pwd", {pwd_accepts, [&shell](const Args &args) {
+                  return pwd(shell, args);
+                }});
+  }
+  if (wanted("echo")) {
+    shell.add_fast_command("echo", {echo_accepts, echo});
+  }
+  if (wanted("cat")) {
+    shell.add_fast_command("cat", {cat_accepts, cat});
+  }
+  if (wanted("ls")) {
+    shell.add_fast_command("ls", {ls_accepts, ls});
+  }
+  if (wanted("test")) {
+    FastCommand command{
+        [](const Args &args) { return test(args).has_value(); },
+        [](const Args &args) {
+          return *test(args) ? EXIT_SUCCESS : EXIT_FAILURE;
+        }};
+    shell.add_fast_command("test", command);
+    shell.add_fast_command("[", command);
+  }
+}
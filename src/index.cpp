@@ -0,0 +1,1089 @@
+#include "tbsh.h"
+
+bool IgnoreRules::has_glob(std::string_view s) {
+  return s.find_first_of("*?[\\") != std::string_view::npos;
+}
+
+bool IgnoreRules::glob_match(std::string_view p, std::string_view s) {
+  while (!p.empty()) {
+    char c = p[0];
+    if (c == '*') {
+      bool deep = p.size() > 1 && p[1] == '*';
+      p.remove_prefix(deep ? 2 : 1);
+      if (deep && !p.empty() && p[0] == '/') {
+        // `**/` also matches no directories at all.
+        if (glob_match(p.substr(1), s)) {
+          return true;
+        }
+      }
+      for (size_t i = 0; i <= s.size(); i++) {
+        if (glob_match(p, s.substr(i))) {
+          return true;
+        }
+        if (i < s.size() && s[i] == '/' && !deep) {
+          return false;
+        }
+      }
+      return false;
+    }
+    if (s.empty()) {
+      return false;
+    }
+    if (c == '?') {
+      if (s[0] == '/') {
+        return false;
+      }
+      p.remove_prefix(1);
+    } else if (c == '[') {
+      size_t i = 1;
+      bool invert = i < p.size() && (p[i] == '!' || p[i] == '^');
+      i += invert;
+      bool found = false;
+      for (bool first = true; i < p.size() && (first || p[i] != ']');
+           first = false) {
+        char low = p[i], high = low;
+        if (i + 2 < p.size() && p[i + 1] == '-' && p[i + 2] != ']') {
+          high = p[i + 2];
+          i += 2;
+        }
+        found |= s[0] >= low && s[0] <= high;
+        i++;
+      }
+      if (i >= p.size() || found == invert || s[0] == '/') {
+        return false;
+      }
+      p.remove_prefix(i + 1);
+    } else {
+      if (c == '\\' && p.size() > 1) {
+        p.remove_prefix(1);
+        c = p[0];
+      }
+      if (s[0] != c) {
+        return false;
+      }
+      p.remove_prefix(1);
+    }
+    s.remove_prefix(1);
+  }
+  return s.empty();
+}
+
+std::optional<IgnoreRules::Rule> IgnoreRules::compile(std::string_view line) {
+  while (!line.empty() && (line.back() == ' ' || line.back() == '\r')) {
+    line.remove_suffix(1);
+  }
+  if (line.empty() || line[0] == '#') {
+    return std::nullopt;
+  }
+  Rule rule;
+  if (line[0] == '!') {
+    rule.negated = true;
+    line.remove_prefix(1);
+  }
+  while (!line.empty() && line.back() == '/') {
+    line.remove_suffix(1);
+  }
+  if (line.compare(0, 3, "**/") == 0 &&
+      line.find('/', 3) == std::string_view::npos) {
+    line.remove_prefix(3);
+  }
+  rule.anchored = line.find('/') != std::string_view::npos;
+  if (!line.empty() && line[0] == '/') {
+    line.remove_prefix(1);
+  }
+  if (line.empty()) {
+    return std::nullopt;
+  }
+  if (rule.anchored || has_glob(line.substr(1))) {
+    rule.kind = Rule::Kind::Glob;
+    rule.text = std::string(line);
+  } else if (line[0] == '*') {
+    rule.kind = Rule::Kind::Suffix;
+    rule.text = std::string(line.substr(1));
+  } else {
+    rule.kind = has_glob(line) ? Rule::Kind::Glob : Rule::Kind::Literal;
+    rule.text = std::string(line);
+  }
+  return rule;
+}
+
+bool IgnoreRules::matches(const Rule &rule, std::string_view name,
+                          std::string_view rel) {
+  switch (rule.kind) {
+  case Rule::Kind::Literal:
+    return name == rule.text;
+  case Rule::Kind::Suffix:
+    return name.size() >= rule.text.size() &&
+           name.compare(name.size() - rule.text.size(), rule.text.size(),
+                        rule.text) == 0;
+  case Rule::Kind::Glob:
+    break;
+  }
+  return glob_match(rule.text, rule.anchored ? rel : name);
+}
+
+std::shared_ptr<const IgnoreRules::RuleList>
+IgnoreRules::read(const std::string &path) {
+  struct stat st;
+  if (stat(path.c_str(), &st) != 0 || !S_ISREG(st.st_mode)) {
+    return nullptr;
+  }
+  std::lock_guard<std::mutex> lock(mutex);
+  auto it = cache.find(path);
+  if (it != cache.end() && it->second.size == st.st_size &&
+      it->second.mtime.tv_sec == st.st_mtim.tv_sec &&
+      it->second.mtime.tv_nsec == st.st_mtim.tv_nsec) {
+    return it->second.rules;
+  }
+  auto rules = std::make_shared<RuleList>();
+  std::ifstream in(path);
+  std::string line;
+  while (std::getline(in, line)) {
+    if (auto rule = compile(line)) {
+      rules->push_back(std::move(*rule));
+    }
+  }
+  cache[path] = {st.st_mtim, st.st_size, rules};
+  return rules;
+}
+
+bool IgnoreRules::named_in(std::string_view pattern, std::string_view name) {
+  for (size_t pos = pattern.find(name); pos != std::string_view::npos;
+       pos = pattern.find(name, pos + 1)) {
+    size_t end = pos + name.size();
+    if ((pos == 0 || pattern[pos - 1] == '/') && end < pattern.size() &&
+        pattern[end] == '/') {
+      return true;
+    }
+  }
+  return false;
+}
+
+IgnoreRules::IgnoreRules() {
+  const char *list = getenv("TBSH_SKIP");
+  std::string_view names =
+      list ? list : ".git:.hg:.svn:node_modules:build";
+  while (!names.empty()) {
+    size_t colon = names.find(':');
+    if (colon != 0) {
+      skip_names.emplace(names.substr(0, colon));
+    }
+    names.remove_prefix(colon == std::string_view::npos ? names.size()
+                                                        : colon + 1);
+  }
+}
+
+IgnoreRules::LayerPtr
+IgnoreRules::enter(const LayerPtr &parent, const std::string &dir,
+                   bool has_gitignore, bool has_ignore) {
+  auto gitignore = has_gitignore ? read(dir + "/.gitignore") : nullptr;
+  auto ignore = has_ignore ? read(dir + "/.ignore") : nullptr;
+  if (!gitignore && !ignore) {
+    return parent;
+  }
+  return std::make_shared<Layer>(Layer{parent, dir, gitignore, ignore});
+}
+
+IgnoreRules::LayerPtr IgnoreRules::above(const fs::path &start) {
+  std::vector<fs::path> chain;
+  std::error_code ec;
+  fs::path dir = start;
+  while (!fs::exists(dir / ".git", ec)) {
+    if (dir == dir.root_path() || chain.size() >= 64) {
+      return nullptr;
+    }
+    dir = dir.parent_path();
+    chain.push_back(dir);
+  }
+  LayerPtr layer;
+  for (auto it = chain.rbegin(); it != chain.rend(); ++it) {
+    layer = enter(layer, it->string(), true, true);
+  }
+  return layer;
+}
+
+bool IgnoreRules::skip(const Layer *layer, std::string_view name,
+                       std::string_view path,
+                       const std::vector<std::string> &patterns) const {
+  bool skipped = skip_names.count(std::string(name)) > 0;
+  // Nearer files and later rules win, and .ignore overrides .gitignore, so
+  // the first match found walking backwards decides.
+  for (; layer && !skipped; layer = layer->parent.get()) {
+    std::string_view rel =
+        path.substr(std::min(path.size(), layer->dir.size() + 1));
+    for (const RuleList *rules :
+         {layer->ignore.get(), layer->gitignore.get()}) {
+      if (!rules) {
+        continue;
+      }
+      for (auto it = rules->rbegin(); it != rules->rend(); ++it) {
+        if (matches(*it, name, rel)) {
+          if (it->negated) {
+            return false;
+          }
+          skipped = true;
+          break;
+        }
+      }
+      if (skipped) {
+        break;
+      }
+    }
+  }
+  return skipped &&
+         std::none_of(patterns.begin(), patterns.end(),
+                      [&](const std::string &p) { return named_in(p, name); });
+}
+
+bool IgnoreRules::prunes(const fs::path &path) {
+  static const std::vector<std::string> no_patterns;
+  fs::path parent = path.parent_path();
+  LayerPtr layer = enter(above(parent), parent.string(), true, true);
+  return skip(layer.get(), path.filename().string(), path.string(),
+              no_patterns);
+}
+
+std::string FileIndex::reversed(std::string_view s) {
+  return std::string(s.rbegin(), s.rend());
+}
+
+uint64_t FileIndex::fnv1a(const std::string &s) {
+  uint64_t h = 1469598103934665603ull;
+  for (unsigned char c : s) {
+    h ^= c;
+    h *= 1099511628211ull;
+  }
+  return h;
+}
+
+std::string_view FileIndex::base_entry(size_t i) const {
+  return std::string_view(blob + offsets[i]);
+}
+
+char FileIndex::fold(char c) {
+  return c >= 'A' && c <= 'Z' ? c - 'A' + 'a' : c;
+}
+
+uint64_t FileIndex::char_mask(std::string_view s) {
+  uint64_t mask = 0;
+  for (char c : s) {
+    c = fold(c);
+    if (c >= 'a' && c <= 'z') {
+      mask |= 1ull << (c - 'a');
+    } else if (c >= '0' && c <= '9') {
+      mask |= 1ull << (26 + c - '0');
+    } else {
+      mask |= 1ull << (36 + (static_cast<unsigned char>(c) % 28));
+    }
+  }
+  return mask;
+}
+
+std::optional<int>
+FileIndex::fuzzy_score(std::string_view rev, std::string_view query) {
+  size_t n = rev.size(), m = query.size();
+  if (m == 0) {
+    return 0;
+  }
+  auto at = [&](size_t i) { return rev[n - 1 - i]; };
+
+  size_t qi = 0, end = n;
+  for (size_t i = 0; i < n; i++) {
+    if (fold(at(i)) == query[qi] && ++qi == m) {
+      end = i;
+      break;
+    }
+  }
+  if (end == n) {
+    return std::nullopt;
+  }
+  size_t begin = end;
+  for (size_t i = end + 1, q = m; i-- > 0;) {
+    if (fold(at(i)) == query[q - 1] && --q == 0) {
+      begin = i;
+      break;
+    }
+  }
+
+  int score = 0;
+  bool consecutive = false;
+  for (size_t i = begin, q = 0; i <= end && q < m; i++) {
+    char c = at(i);
+    if (fold(c) != query[q]) {
+      score -= consecutive ? 3 : 1;
+      consecutive = false;
+      continue;
+    }
+    char prev = i == 0 ? '/' : at(i - 1);
+    score += 16;
+    if (prev == '/') {
+      score += 10;
+    } else if (prev == '_' || prev == '-' || prev == '.' || prev == ' ') {
+      score += 8;
+    } else if (c >= 'A' && c <= 'Z' && prev >= 'a' && prev <= 'z') {
+      score += 7;
+    }
+    if (consecutive) {
+      score += 4;
+    }
+    consecutive = true;
+    q++;
+  }
+
+  size_t name_start = rev.find('/');
+  if (name_start == std::string_view::npos || n - name_start <= begin) {
+    score += 12;
+  }
+  return score;
+}
+
+void FileIndex::unmap() {
+  base_masks.clear();
+  if (map) {
+    munmap(map, map_size);
+  }
+  map = nullptr;
+  map_size = 0;
+  offsets = nullptr;
+  blob = nullptr;
+  count = 0;
+}
+
+bool FileIndex::load() {
+  int fd = ::open(index_file.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return false;
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0 || st.st_size < 16) {
+    close(fd);
+    return false;
+  }
+  void *m = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (m == MAP_FAILED) {
+    return false;
+  }
+
+  const char *bytes = static_cast<const char *>(m);
+  uint64_t n;
+  std::memcpy(&n, bytes + 8, sizeof(n));
+  size_t header = 16 + n * sizeof(uint64_t);
+  size_t size = st.st_size;
+  bool valid = std::memcmp(bytes, magic, sizeof(magic)) == 0 &&
+               n <= (size - 16) / sizeof(uint64_t);
+  // Every entry must lie inside the blob and end in a NUL before the next
+  // one starts, or a corrupt file would be read past its mapping.
+  size_t blob_size = valid ? size - header : 0;
+  for (uint64_t i = 0; valid && i < n; i++) {
+    uint64_t start, end = blob_size;
+    std::memcpy(&start, bytes + 16 + i * sizeof(start), sizeof(start));
+    if (i + 1 < n) {
+      std::memcpy(&end, bytes + 16 + (i + 1) * sizeof(end), sizeof(end));
+    }
+    valid = start < end && end <= blob_size &&
+            bytes[header + end - 1] == '\0';
+  }
+  if (!valid) {
+    munmap(m, st.st_size);
+    return false;
+  }
+
+  map = m;
+  map_size = st.st_size;
+  offsets = reinterpret_cast<const uint64_t *>(bytes + 16);
+  blob = bytes + header;
+  count = n;
+  return true;
+}
+
+std::vector<std::string_view> FileIndex::merged_locked() const {
+  std::vector<std::string_view> entries;
+  entries.reserve(count + added.size());
+  auto overlay = added.begin();
+  for (size_t i = 0; i < count; i++) {
+    std::string_view entry = base_entry(i);
+    while (overlay != added.end() && std::string_view(*overlay) < entry) {
+      entries.push_back(*overlay++);
+    }
+    if (overlay != added.end() && std::string_view(*overlay) == entry) {
+      ++overlay;
+    }
+    if (!removed.count(std::string(entry))) {
+      entries.push_back(entry);
+    }
+  }
+  for (; overlay != added.end(); ++overlay) {
+    entries.push_back(*overlay);
+  }
+  return entries;
+}
+
+void FileIndex::save_locked() {
+  std::vector<std::string_view> entries = merged_locked();
+  fs::create_directories(index_file.parent_path());
+  // Shells and tbshd may save the same index at once; each writes its own
+  // file, and the last rename wins.
+  fs::path tmp = unique_temp_beside(index_file);
+  if (tmp.empty()) {
+    throw std::runtime_error("Failed to create a file beside " +
+                             index_file.string() + ": " + strerror(errno));
+  }
+  {
+    std::ofstream out(tmp, std::ios::binary | std::ios::trunc);
+    uint64_t n = entries.size();
+    out.write(magic, sizeof(magic));
+    out.write(reinterpret_cast<const char *>(&n), sizeof(n));
+    uint64_t offset = 0;
+    for (std::string_view entry : entries) {
+      out.write(reinterpret_cast<const char *>(&offset), sizeof(offset));
+      offset += entry.size() + 1;
+    }
+    for (std::string_view entry : entries) {
+      out.write(entry.data(), entry.size());
+      out.put('\0');
+    }
+    if (!out) {
+      std::error_code ec;
+      fs::remove(tmp, ec);
+      throw std::runtime_error("Failed to write index " + tmp.string());
+    }
+  }
+  std::error_code ec;
+  fs::rename(tmp, index_file, ec);
+  if (ec) {
+    fs::remove(tmp, ec);
+    throw std::runtime_error("Failed to replace index " +
+                             index_file.string());
+  }
+
+  // The views in `entries` point into the old mapping and the overlay, so
+  // both are only released once the new file is in place.
+  unmap();
+  added.clear();
+  removed.clear();
+  dirty = false;
+  if (!load()) {
+    throw std::runtime_error("Failed to map index " + index_file.string());
+  }
+}
+
+FileIndex::FileIndex(const fs::path &root) : root_path(root) {
+  const char *cache = getenv("XDG_CACHE_HOME");
+  const char *home = getenv("HOME");
+  fs::path dir = cache ? fs::path(cache) / "tbsh"
+                       : fs::path(home ? home : "/tmp") / ".cache" / "tbsh";
+  char name[32];
+  snprintf(name, sizeof(name), "index-%016llx",
+           static_cast<unsigned long long>(fnv1a(root_path.string())));
+  index_file = dir / name;
+}
+
+FileIndex::~FileIndex() {
+  if (dirty) {
+    try {
+      save_locked();
+    } catch (const std::exception &e) {
+      std::cerr << "[index error] " << e.what() << std::endl;
+    }
+  }
+  unmap();
+}
+
+void FileIndex::open(IgnoreRules &ignore) {
+  bool loaded;
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    loaded = load();
+  }
+  if (!loaded) {
+    rebuild(ignore);
+  }
+}
+
+void FileIndex::rebuild(IgnoreRules &ignore) {
+  std::vector<std::string> files;
+  ignore.walk(
+      root_path, "", [](const std::string &) { return true; },
+      [&](std::string rel) { files.push_back(std::move(rel)); });
+  assign(files);
+}
+
+void FileIndex::assign(const std::vector<std::string> &files) {
+  std::vector<std::string> keys;
+  keys.reserve(files.size());
+  for (const std::string &file : files) {
+    keys.push_back(reversed(file));
+  }
+  std::sort(keys.begin(), keys.end());
+  std::lock_guard<std::mutex> lock(mutex);
+  std::vector<std::string_view> current = merged_locked();
+  if (std::equal(current.begin(), current.end(), keys.begin(), keys.end())) {
+    return;
+  }
+  unmap();
+  added.clear();
+  removed.clear();
+  for (std::string &key : keys) {
+    added.insert(std::move(key));
+  }
+  dirty = true;
+  save_locked();
+}
+
+void FileIndex::add(const std::string &rel_path) {
+  std::lock_guard<std::mutex> lock(mutex);
+  std::string key = reversed(rel_path);
+  removed.erase(key);
+  added.insert(std::move(key));
+  dirty = true;
+}
+
+void FileIndex::remove(const std::string &rel_path) {
+  std::lock_guard<std::mutex> lock(mutex);
+  std::string key = reversed(rel_path);
+  added.erase(key);
+  removed.insert(std::move(key));
+  dirty = true;
+}
+
+void FileIndex::remove_tree(const std::string &rel_dir) {
+  std::lock_guard<std::mutex> lock(mutex);
+  std::string tail = reversed(rel_dir + "/");
+  auto below = [&](std::string_view rev) {
+    return rev.size() >= tail.size() &&
+           rev.compare(rev.size() - tail.size(), tail.size(), tail) == 0;
+  };
+  for (auto it = added.begin(); it != added.end();) {
+    it = below(*it) ? added.erase(it) : std::next(it);
+  }
+  for (size_t i = 0; i < count; i++) {
+    if (below(base_entry(i))) {
+      removed.insert(std::string(base_entry(i)));
+    }
+  }
+  dirty = true;
+}
+
+std::optional<std::string> FileIndex::find_suffix(
+    const std::string &pattern, const std::string &scope) const {
+  std::lock_guard<std::mutex> lock(mutex);
+  std::string key = reversed(pattern);
+  std::optional<std::string> best;
+  size_t best_depth = 0;
+
+  auto consider = [&](std::string_view rev) {
+    if (removed.count(std::string(rev))) {
+      return;
+    }
+    std::string rel = reversed(rev);
+    if (!scope.empty()) {
+      if (rel.size() < scope.size() + 1 + pattern.size() ||
+          rel.compare(0, scope.size(), scope) != 0 ||
+          rel[scope.size()] != '/') {
+        return;
+      }
+    }
+    size_t depth = std::count(rel.begin(), rel.end(), '/');
+    if (!best || depth < best_depth || (depth == best_depth && rel < *best)) {
+      best = std::move(rel);
+      best_depth = depth;
+    }
+  };
+
+  size_t lo = 0, hi = count;
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    if (base_entry(mid) < key) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  for (size_t i = lo; i < count; i++) {
+    std::string_view entry = base_entry(i);
+    if (entry.compare(0, key.size(), key) != 0) {
+      break;
+    }
+    consider(entry);
+  }
+
+  for (auto it = added.lower_bound(key);
+       it != added.end() && it->compare(0, key.size(), key) == 0; ++it) {
+    consider(*it);
+  }
+  return best;
+}
+
+std::vector<FileIndex::FuzzyMatch> FileIndex::fuzzy_find(
+    const std::string &query, const std::string &scope, size_t limit) const {
+  std::lock_guard<std::mutex> lock(mutex);
+  std::string folded;
+  for (char c : query) {
+    folded += fold(c);
+  }
+  uint64_t want = char_mask(folded);
+  if (base_masks.size() != count) {
+    base_masks.resize(count);
+    for (size_t i = 0; i < count; i++) {
+      base_masks[i] = char_mask(base_entry(i));
+    }
+  }
+
+  struct Ranked {
+    std::string_view rev;
+    int score;
+  };
+  auto better = [](const Ranked &a, const Ranked &b) {
+    if (a.score != b.score) {
+      return a.score > b.score;
+    }
+    if (a.rev.size() != b.rev.size()) {
+      return a.rev.size() < b.rev.size();
+    }
+    return a.rev < b.rev;
+  };
+  std::vector<Ranked> heap;
+
+  size_t skip = scope.empty() ? 0 : scope.size() + 1;
+  std::string scope_rev = reversed(scope);
+  auto consider = [&](std::string_view rev) {
+    if (rev.size() <= skip) {
+      return;
+    }
+    if (skip && (rev.compare(rev.size() - scope.size(), scope.size(),
+                             scope_rev) != 0 ||
+                 rev[rev.size() - skip] != '/')) {
+      return;
+    }
+    if (!removed.empty() && removed.count(std::string(rev))) {
+      return;
+    }
+    std::optional<int> score =
+        fuzzy_score(rev.substr(0, rev.size() - skip), folded);
+    if (!score) {
+      return;
+    }
+    Ranked ranked{rev, *score};
+    if (heap.size() < limit) {
+      heap.push_back(ranked);
+      std::push_heap(heap.begin(), heap.end(), better);
+    } else if (better(ranked, heap.front())) {
+      std::pop_heap(heap.begin(), heap.end(), better);
+      heap.back() = ranked;
+      std::push_heap(heap.begin(), heap.end(), better);
+    }
+  };
+
+  // The mask test is a branch-free pass over a flat array, which the
+  // compiler vectorizes; only survivors reach the scorer.
+  const uint64_t *masks = base_masks.data();
+  constexpr size_t block = 256;
+  uint8_t hit[block];
+  for (size_t start = 0; start < count; start += block) {
+    size_t n = std::min(block, count - start);
+    for (size_t i = 0; i < n; i++) {
+      hit[i] = (masks[start + i] & want) == want;
+    }
+    for (size_t i = 0; i < n; i++) {
+      if (hit[i]) {
+        consider(base_entry(start + i));
+      }
+    }
+  }
+  for (const std::string &rev : added) {
+    if ((char_mask(rev) & want) == want) {
+      consider(rev);
+    }
+  }
+
+  std::sort_heap(heap.begin(), heap.end(), better);
+  std::vector<FuzzyMatch> result;
+  for (const Ranked &ranked : heap) {
+    result.push_back({reversed(ranked.rev), ranked.score});
+  }
+  return result;
+}
+
+void FileIndex::save() {
+  std::lock_guard<std::mutex> lock(mutex);
+  save_locked();
+}
+
+std::string IndexWatcher::join(const std::string &dir, const char *name) {
+  return dir.empty() ? std::string(name) : dir + "/" + name;
+}
+
+bool IndexWatcher::watch_tree(const std::string &rel_dir,
+                              std::vector<std::string> &files) {
+  bool out_of_watches = false;
+  ignore.walk(
+      index.root(), rel_dir,
+      [&](const std::string &rel) {
+        if (stopping) {
+          return false;
+        }
+        fs::path dir = rel.empty() ? index.root() : index.root() / rel;
+        int wd = inotify_add_watch(inotify_fd, dir.c_str(), watch_mask);
+        if (wd < 0) {
+          out_of_watches = errno == ENOSPC;
+          return !out_of_watches;
+        }
+        watched_dirs[wd] = rel;
+        return true;
+      },
+      [&](std::string rel) { files.push_back(std::move(rel)); });
+  return !out_of_watches;
+}
+
+void IndexWatcher::unwatch_tree(const std::string &rel_dir) {
+  std::string prefix = rel_dir + "/";
+  for (auto it = watched_dirs.begin(); it != watched_dirs.end();) {
+    if (it->second == rel_dir || it->second.compare(0, prefix.size(),
+                                                    prefix) == 0) {
+      inotify_rm_watch(inotify_fd, it->first);
+      it = watched_dirs.erase(it);
+    } else {
+      ++it;
+    }
+  }
+}
+
+void IndexWatcher::give_up() {
+  is_ready = false;
+  for (const auto &[wd, dir] : watched_dirs) {
+    inotify_rm_watch(inotify_fd, wd);
+  }
+  watched_dirs.clear();
+  close(inotify_fd);
+  inotify_fd = -1;
+  std::cerr << "[index watcher] out of inotify watches, "
+               "falling back to validated lookups"
+            << std::endl;
+}
+
+bool IndexWatcher::handle(const struct inotify_event &event) {
+  if (event.mask & IN_Q_OVERFLOW) {
+    // Events were dropped; start over from a clean set of watches.
+    for (const auto &[wd, dir] : watched_dirs) {
+      inotify_rm_watch(inotify_fd, wd);
+    }
+    watched_dirs.clear();
+    std::vector<std::string> files;
+    if (!watch_tree("", files)) {
+      return false;
+    }
+    if (!stopping) {
+      index.assign(files);
+    }
+    return true;
+  }
+  if (event.mask & IN_IGNORED) {
+    watched_dirs.erase(event.wd);
+    return true;
+  }
+  auto dir = watched_dirs.find(event.wd);
+  if (dir == watched_dirs.end() || event.len == 0) {
+    return true;
+  }
+  std::string rel = join(dir->second, event.name);
+
+  if (event.mask & IN_ISDIR) {
+    if (event.mask & (IN_CREATE | IN_MOVED_TO)) {
+      if (std::strcmp(event.name, ".git") == 0 ||
+          ignore.prunes(index.root() / rel)) {
+        return true;
+      }
+      std::vector<std::string> files;
+      if (!watch_tree(rel, files)) {
+        return false;
+      }
+      for (const std::string &file : files) {
+        index.add(file);
+      }
+    } else if (event.mask & (IN_DELETE | IN_MOVED_FROM)) {
+      unwatch_tree(rel);
+      index.remove_tree(rel);
+    }
+  } else if (event.mask & (IN_CREATE | IN_MOVED_TO)) {
+    index.add(rel);
+  } else if (event.mask & (IN_DELETE | IN_MOVED_FROM)) {
+    index.remove(rel);
+  }
+  return true;
+}
+
+void IndexWatcher::loop() {
+  std::vector<std::string> files;
+  if (!watch_tree("", files)) {
+    give_up();
+    return;
+  }
+  if (stopping) {
+    return;
+  }
+  index.assign(files);
+  is_ready = true;
+
+  alignas(struct inotify_event) char buffer[64 * 1024];
+  struct pollfd fds[2] = {{inotify_fd, POLLIN, 0}, {wake_fd, POLLIN, 0}};
+  while (true) {
+    if (poll(fds, 2, -1) < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      break;
+    }
+    if (fds[1].revents) {
+      break;
+    }
+    ssize_t len = read(inotify_fd, buffer, sizeof(buffer));
+    if (len <= 0) {
+      continue;
+    }
+    for (char *p = buffer; p < buffer + len;) {
+      auto *event = reinterpret_cast<struct inotify_event *>(p);
+      if (!handle(*event)) {
+        give_up();
+        return;
+      }
+      p += sizeof(struct inotify_event) + event->len;
+    }
+  }
+  is_ready = false;
+}
+
+IndexWatcher::IndexWatcher(FileIndex &index, IgnoreRules &ignore)
+    : index(index), ignore(ignore) {
+  inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  wake_fd = eventfd(0, EFD_CLOEXEC);
+  if (inotify_fd < 0 || wake_fd < 0) {
+    throw std::runtime_error(std::string("inotify setup failed: ") +
+                             strerror(errno));
+  }
+  thread = std::thread([this] {
+    try {
+      loop();
+    } catch (const std::exception &e) {
+      is_ready = false;
+      std::cerr << "[index watcher] " << e.what() << std::endl;
+    }
+  });
+}
+
+IndexWatcher::~IndexWatcher() {
+  stopping = true;
+  uint64_t one = 1;
+  if (write(wake_fd, &one, sizeof(one)) < 0) {
+    perror("index watcher wakeup failed");
+  }
+  thread.join();
+  if (inotify_fd >= 0) {
+    close(inotify_fd);
+  }
+  close(wake_fd);
+}
+
+bool ParallelWalker::matches(const std::string &rel,
+                             const std::string &pattern) {
+  return rel.size() >= pattern.size() &&
+         rel.compare(rel.size() - pattern.size(), pattern.size(),
+                     pattern) == 0;
+}
+
+void ParallelWalker::scan(Shard &shard, const Dir &dir) {
+  int fd = dir.rel.empty()
+               ? dup(root_fd)
+               : openat(root_fd, dir.rel.c_str(),
+                        O_RDONLY | O_DIRECTORY | O_CLOEXEC | O_NOFOLLOW);
+  if (fd < 0) {
+    return;
+  }
+
+  // Subdirectories are only queued once the whole listing is known, since
+  // an ignore file in it may prune them.
+  std::vector<std::string> subdirs;
+  bool has_gitignore = false, has_ignore = false;
+  alignas(linux_dirent64) char buffer[32 * 1024];
+  long len;
+  while ((len = syscall(SYS_getdents64, fd, buffer, sizeof(buffer))) > 0) {
+    for (long pos = 0; pos < len;) {
+      auto *entry = reinterpret_cast<linux_dirent64 *>(buffer + pos);
+      pos += entry->d_reclen;
+      const char *name = entry->d_name;
+      if (name[0] == '.' &&
+          (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'))) {
+        continue;
+      }
+      shard.entries++;
+
+      unsigned char type = entry->d_type;
+      if (type == DT_UNKNOWN) {
+        struct stat st;
+        if (fstatat(fd, name, &st, AT_SYMLINK_NOFOLLOW) == 0) {
+          type = S_ISDIR(st.st_mode) ? DT_DIR : DT_REG;
+        }
+      }
+
+      std::string rel =
+          dir.rel.empty() ? std::string(name) : dir.rel + "/" + name;
+      if (type == DT_DIR) {
+        subdirs.push_back(std::move(rel));
+        continue;
+      }
+      has_gitignore |= std::strcmp(name, ".gitignore") == 0;
+      has_ignore |= std::strcmp(name, ".ignore") == 0;
+      for (size_t i = 0; i < patterns->size(); i++) {
+        std::optional<std::string> &best = shard.best[i];
+        if (!(*found)[i] && matches(rel, (*patterns)[i]) &&
+            (!best || rel < *best)) {
+          best = rel;
+        }
+      }
+    }
+  }
+  close(fd);
+
+  IgnoreRules::LayerPtr layer = dir.layer;
+  if (ignore) {
+    layer = ignore->enter(dir.layer, join(dir.rel), has_gitignore,
+                          has_ignore);
+  }
+  for (std::string &rel : subdirs) {
+    if (ignore) {
+      std::string_view name(rel);
+      name.remove_prefix(dir.rel.empty() ? 0 : dir.rel.size() + 1);
+      if (ignore->skip(layer.get(), name, join(rel), *patterns)) {
+        continue;
+      }
+    }
+    shard.next.push_back({std::move(rel), layer});
+  }
+}
+
+std::string ParallelWalker::join(const std::string &rel) const {
+  return rel.empty() ? start_dir : start_dir + "/" + rel;
+}
+
+void ParallelWalker::drain(Shard &shard) {
+  for (size_t i; (i = next_dir.fetch_add(1)) < level.size();) {
+    scan(shard, level[i]);
+  }
+}
+
+void ParallelWalker::serve(size_t self, uint64_t seen) {
+  std::unique_lock<std::mutex> lock(mutex);
+  for (;;) {
+    wake.wait(lock, [&] { return stopping || generation != seen; });
+    if (stopping) {
+      return;
+    }
+    seen = generation;
+    lock.unlock();
+    drain(shards[self]);
+    lock.lock();
+    if (--busy == 0) {
+      done.notify_one();
+    }
+  }
+}
+
+void ParallelWalker::stop_threads() {
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    stopping = true;
+  }
+  wake.notify_all();
+  for (auto &thread : threads) {
+    thread.join();
+  }
+  threads.clear();
+  stopping = false;
+}
+
+void ParallelWalker::walk_level() {
+  next_dir = 0;
+  if (level.size() == 1 || threads.empty()) {
+    drain(shards[0]);
+    return;
+  }
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    busy = threads.size();
+    generation++;
+  }
+  wake.notify_all();
+  drain(shards[0]);
+  std::unique_lock<std::mutex> lock(mutex);
+  done.wait(lock, [&] { return busy == 0; });
+}
+
+std::vector<std::optional<std::string>> ParallelWalker::search(
+    const std::vector<std::string> &patterns, const fs::path &start,
+    size_t limit, size_t threads, IgnoreRules *ignore) {
+  std::lock_guard<std::mutex> searching(search_mutex);
+  root_fd = ::open(start.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (root_fd < 0) {
+    throw std::runtime_error("Cannot open " + start.string() + ": " +
+                             strerror(errno));
+  }
+
+  threads = std::max<size_t>(threads, 1);
+  if (this->threads.size() != threads - 1) {
+    stop_threads();
+    for (size_t i = 1; i < threads; i++) {
+      this->threads.emplace_back(&ParallelWalker::serve, this, i,
+                                 generation);
+    }
+  }
+  shards.resize(threads);
+  std::vector<std::optional<std::string>> result(patterns.size());
+  for (Shard &shard : shards) {
+    shard.best.assign(patterns.size(), std::nullopt);
+  }
+  this->patterns = &patterns;
+  this->found = &result;
+  this->ignore = ignore;
+  start_dir = start.string();
+  level.clear();
+  level.push_back({"", ignore ? ignore->above(start) : nullptr});
+  limit_hit = false;
+
+  size_t visited = 0, unmatched = patterns.size();
+  std::vector<Dir> next;
+  while (!level.empty() && unmatched > 0) {
+    if (visited >= limit) {
+      limit_hit = true;
+      break;
+    }
+    walk_level();
+
+    std::vector<std::optional<std::string>> level_best(patterns.size());
+    next.clear();
+    for (Shard &shard : shards) {
+      visited += shard.entries;
+      shard.entries = 0;
+      for (size_t i = 0; i < patterns.size(); i++) {
+        std::optional<std::string> &best = shard.best[i];
+        if (best && (!level_best[i] || *best < *level_best[i])) {
+          level_best[i] = std::move(best);
+        }
+        best.reset();
+      }
+      std::move(shard.next.begin(), shard.next.end(),
+                std::back_inserter(next));
+      shard.next.clear();
+    }
+    for (size_t i = 0; i < patterns.size(); i++) {
+      if (level_best[i]) {
+        result[i] = (start / *level_best[i]).string();
+        unmatched--;
+      }
+    }
+    level.swap(next);
+  }
+  level.clear();
+  close(root_fd);
+  root_fd = -1;
+  return result;
+}
@@ -0,0 +1,104 @@
+#include "tbsh.h"
+
+const char *JobTable::state_name(const Job &job) {
+  switch (job.state) {
+  case State::Running:
+    return "Running";
+  case State::Stopped:
+    return "Stopped";
+  case State::Done:
+    break;
+  }
+  if (WIFSIGNALED(job.status)) {
+    return strsignal(WTERMSIG(job.status));
+  }
+  return WEXITSTATUS(job.status) == 0 ? "Done" : "Exit";
+}
+
+JobTable::Job &JobTable::add(pid_t pgid, std::vector<pid_t> pids,
+                             std::string command) {
+  int id = jobs.empty() ? 1 : jobs.rbegin()->first + 1;
+  size_t live = pids.size();
+  return jobs[id] = {id, pgid, std::move(command), std::move(pids), live};
+}
+
+JobTable::Job *JobTable::find(std::string_view spec) {
+  if (spec.empty()) {
+    return jobs.empty() ? nullptr : &jobs.rbegin()->second;
+  }
+  if (spec[0] == '%') {
+    spec.remove_prefix(1);
+  }
+  int id = 0;
+  for (char c : spec) {
+    if (c < '0' || c > '9') {
+      return nullptr;
+    }
+    id = id * 10 + (c - '0');
+  }
+  auto it = jobs.find(id);
+  return it == jobs.end() ? nullptr : &it->second;
+}
+
+void JobTable::add_usage(struct rusage &total, const struct rusage &usage) {
+  timeradd(&total.ru_utime, &usage.ru_utime, &total.ru_utime);
+  timeradd(&total.ru_stime, &usage.ru_stime, &total.ru_stime);
+  total.ru_maxrss = std::max(total.ru_maxrss, usage.ru_maxrss);
+  total.ru_nvcsw += usage.ru_nvcsw;
+  total.ru_nivcsw += usage.ru_nivcsw;
+}
+
+void JobTable::update(pid_t pid, int status, const struct rusage &usage) {
+  for (auto &[id, job] : jobs) {
+    if (std::find(job.pids.begin(), job.pids.end(), pid) == job.pids.end()) {
+      continue;
+    }
+    if (WIFSTOPPED(status)) {
+      job.state = State::Stopped;
+    } else if (WIFCONTINUED(status)) {
+      job.state = State::Running;
+      return;
+    } else {
+      add_usage(job.usage, usage);
+      if (pid == job.pids.back()) {
+        job.status = status;
+      }
+      if (--job.live == 0) {
+        job.state = State::Done;
+      }
+    }
+    job.changed = true;
+    return;
+  }
+}
+
+bool JobTable::has_changes() const {
+  return std::any_of(jobs.begin(), jobs.end(),
+                     [](const auto &entry) { return entry.second.changed; });
+}
+
+std::vector<int> JobTable::ids() const {
+  std::vector<int> result;
+  for (const auto &[id, job] : jobs) {
+    result.push_back(id);
+  }
+  return result;
+}
+
+void JobTable::report(std::ostream &out, bool changed_only) {
+  int current = jobs.empty() ? 0 : jobs.rbegin()->first;
+  for (auto it = jobs.begin(); it != jobs.end();) {
+    Job &job = it->second;
+    if (!changed_only || job.changed) {
+      out << "[" << job.id << "]" << (job.id == current ? "+" : " ") << "  "
+          << std::left << std::setw(24) << state_name(job) << std::right
+          << job.command << std::endl;
+      job.changed = false;
+      if (job.state == State::Done) {
+        it = jobs.erase(it);
+        continue;
+      }
+    }
+    ++it;
+  }
+}
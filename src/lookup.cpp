@@ -0,0 +1,346 @@
+#include "tbsh.h"
+
+struct timespec PathCache::mtime_of(const std::string &dir) {
+  struct stat st;
+  if (stat(dir.c_str(), &st) != 0) {
+    return {0, 0};
+  }
+  return st.st_mtim;
+}
+
+bool PathCache::is_executable(const std::string &path) {
+  struct stat st;
+  return stat(path.c_str(), &st) == 0 && S_ISREG(st.st_mode) &&
+         access(path.c_str(), X_OK) == 0;
+}
+
+void PathCache::refresh() {
+  const char *env = getenv("PATH");
+  std::string value = env ? env : "/usr/local/bin:/usr/bin:/bin";
+  if (!path_env || *path_env != value) {
+    path_env = value;
+    dirs.clear();
+    commands.clear();
+    size_t start = 0;
+    while (true) {
+      size_t end = value.find(':', start);
+      std::string dir = value.substr(start, end - start);
+      if (dir.empty()) {
+        dir = ".";
+      }
+      dirs.push_back({dir, mtime_of(dir)});
+      if (end == std::string::npos) {
+        break;
+      }
+      start = end + 1;
+    }
+    return;
+  }
+
+  for (Dir &dir : dirs) {
+    struct timespec mtime = mtime_of(dir.path);
+    if (mtime.tv_sec != dir.mtime.tv_sec ||
+        mtime.tv_nsec != dir.mtime.tv_nsec) {
+      dir.mtime = mtime;
+      commands.clear();
+    }
+  }
+}
+
+std::optional<std::string> PathCache::lookup(const std::string &name) {
+  if (name.find('/') != std::string::npos) {
+    return name;
+  }
+  if (!path_env) {
+    refresh();
+  }
+  auto it = commands.find(name);
+  global_stats.count(Stats::Cache::Path, it != commands.end());
+  if (it != commands.end()) {
+    it->second.hits++;
+    return it->second.path;
+  }
+  for (const Dir &dir : dirs) {
+    std::string candidate = dir.path + "/" + name;
+    if (is_executable(candidate)) {
+      if (dir.path[0] == '/') {
+        commands[name] = {candidate, 1};
+      }
+      return candidate;
+    }
+  }
+  return std::nullopt;
+}
+
+std::vector<std::string> PathCache::directories() {
+  if (!path_env) {
+    refresh();
+  }
+  std::vector<std::string> result;
+  for (const Dir &dir : dirs) {
+    result.push_back(dir.path);
+  }
+  return result;
+}
+
+void PathCache::print(std::ostream &out) const {
+  std::vector<std::pair<std::string, const Entry *>> sorted;
+  for (const auto &[name, entry] : commands) {
+    sorted.emplace_back(name, &entry);
+  }
+  std::sort(sorted.begin(), sorted.end());
+  if (sorted.empty()) {
+    out << "hash: hash table empty" << std::endl;
+    return;
+  }
+  out << "hits\tcommand" << std::endl;
+  for (const auto &[name, entry] : sorted) {
+    out << std::setw(4) << entry->hits << "\t" << entry->path << std::endl;
+  }
+}
+
+int CompletionCache::compare_folded(std::string_view a, std::string_view b,
+                                    size_t n) {
+  size_t len = std::min({a.size(), b.size(), n});
+  for (size_t i = 0; i < len; i++) {
+    int ca = std::tolower(static_cast<unsigned char>(a[i]));
+    int cb = std::tolower(static_cast<unsigned char>(b[i]));
+    if (ca != cb) {
+      return ca - cb;
+    }
+  }
+  if (n != std::string_view::npos && len == n) {
+    return 0;
+  }
+  return a.size() < b.size() ? -1 : a.size() > b.size() ? 1 : 0;
+}
+
+void CompletionCache::read_listing(const std::string &dir, Listing &listing) {
+  listing.entries.clear();
+  DIR *d = opendir(dir.c_str());
+  if (!d) {
+    return;
+  }
+  while (struct dirent *entry = readdir(d)) {
+    const char *name = entry->d_name;
+    if (name[0] == '.' &&
+        (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'))) {
+      continue;
+    }
+    unsigned char type = entry->d_type;
+    if (type == DT_UNKNOWN || type == DT_LNK) {
+      struct stat st;
+      if (fstatat(dirfd(d), name, &st, 0) == 0) {
+        type = S_ISDIR(st.st_mode) ? DT_DIR : DT_REG;
+      }
+    }
+    listing.entries.push_back({name, type == DT_DIR, type != DT_DIR});
+  }
+  closedir(d);
+  std::sort(listing.entries.begin(), listing.entries.end(),
+            [](const Entry &a, const Entry &b) {
+              int c = compare_folded(a.name, b.name);
+              return c != 0 ? c < 0 : a.name < b.name;
+            });
+}
+
+const std::vector<CompletionCache::Entry> &CompletionCache::entries(
+    const std::string &dir) {
+  struct stat st;
+  if (stat(dir.c_str(), &st) != 0) {
+    listings.erase(dir);
+    static const std::vector<Entry> none;
+    return none;
+  }
+  auto it = listings.find(dir);
+  if (it != listings.end() &&
+      it->second.mtime.tv_sec == st.st_mtim.tv_sec &&
+      it->second.mtime.tv_nsec == st.st_mtim.tv_nsec) {
+    global_stats.count(Stats::Cache::Completion, true);
+    return it->second.entries;
+  }
+  global_stats.count(Stats::Cache::Completion, false);
+  if (it == listings.end() && listings.size() >= max_listings) {
+    listings.clear();
+  }
+  if (last.dir == dir) {
+    last = {};
+  }
+  Listing &listing = listings[dir];
+  listing.mtime = st.st_mtim;
+  read_listing(dir, listing);
+  return listing.entries;
+}
+
+std::vector<const CompletionCache::Entry *>
+CompletionCache::matches(const std::string &dir, const std::string &prefix) {
+  const std::vector<Entry> &all = entries(dir);
+  size_t lo = 0, hi = all.size();
+  if (last.dir == dir && hi >= last.hi &&
+      prefix.size() >= last.prefix.size() &&
+      compare_folded(prefix, last.prefix, last.prefix.size()) == 0) {
+    lo = last.lo;
+    hi = last.hi;
+  }
+
+  auto begin = all.begin() + lo, end = all.begin() + hi;
+  begin = std::partition_point(begin, end, [&](const Entry &e) {
+    return compare_folded(e.name, prefix, prefix.size()) < 0;
+  });
+  end = std::partition_point(begin, end, [&](const Entry &e) {
+    return compare_folded(e.name, prefix, prefix.size()) == 0;
+  });
+  last = {dir, prefix, size_t(begin - all.begin()),
+          size_t(end - all.begin())};
+
+  std::vector<const Entry *> result;
+  for (auto it = begin; it != end; ++it) {
+    if (it->name[0] != '.' || (!prefix.empty() && prefix[0] == '.')) {
+      result.push_back(&*it);
+    }
+  }
+  return result;
+}
+
+bool SigilScanner::is_path_char(char c) {
+  return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') ||
+         (c >= '0' && c <= '9') || c == '_' || c == '.' || c == '-' ||
+         c == '/';
+}
+
+void SigilScanner::append_quoted(std::pmr::string &out, std::string_view path) {
+  if (!path.empty() && std::all_of(path.begin(), path.end(), [](char c) {
+        return is_path_char(c) || c == '+' || c == ',' || c == ':' ||
+               c == '@' || c == '%' || c == '=';
+      })) {
+    out += path;
+    return;
+  }
+  out += '\'';
+  for (char c : path) {
+    if (c == '\'') {
+      out += "'\\''";
+    } else {
+      out += c;
+    }
+  }
+  out += '\'';
+}
+
+std::optional<SigilScanner::Token> SigilScanner::next() {
+  while (pos < line.size()) {
+    size_t start = line.find_first_of("<>'\"\\", pos);
+    if (start == std::string_view::npos) {
+      break;
+    }
+    if (line[start] == '\\') {
+      pos = start + 2;
+      continue;
+    }
+    if (line[start] == '\'') {
+      size_t close = line.find('\'', start + 1);
+      pos = close == std::string_view::npos ? line.size() : close + 1;
+      continue;
+    }
+    if (line[start] == '"') {
+      for (pos = start + 1; pos < line.size() && line[pos] != '"'; pos++) {
+        if (line[pos] == '\\') {
+          pos++;
+        }
+      }
+      pos++;
+      continue;
+    }
+    size_t end = start + 1;
+    while (end < line.size() && is_path_char(line[end])) {
+      end++;
+    }
+    pos = end;
+    if (end > start + 1) {
+      return Token{start, line[start],
+                   line.substr(start + 1, end - start - 1)};
+    }
+  }
+  pos = line.size();
+  return std::nullopt;
+}
+
+std::string Prefetcher::key(char direction, std::string_view pattern,
+                            const std::string &dir) {
+  std::string result(1, direction);
+  result += dir;
+  result += '\0';
+  result += pattern;
+  return result;
+}
+
+void Prefetcher::run() {
+  std::unique_lock<std::mutex> lock(mutex);
+  while (true) {
+    changed.wait(lock, [&] { return stopping || !queue.empty(); });
+    if (stopping) {
+      return;
+    }
+    in_flight = std::move(queue.front());
+    queue.pop_front();
+    size_t nul = in_flight.find('\0');
+    char direction = in_flight[0];
+    std::string dir = in_flight.substr(1, nul - 1);
+    std::string pattern = in_flight.substr(nul + 1);
+    lock.unlock();
+    std::optional<std::string> found = resolver(direction, pattern, dir);
+    lock.lock();
+    if (found) {
+      results[in_flight] = std::move(*found);
+    }
+    in_flight.clear();
+    changed.notify_all();
+  }
+}
+
+Prefetcher::Prefetcher(Resolver resolver) : resolver(std::move(resolver)) {
+  worker = std::thread([this] { run(); });
+}
+
+Prefetcher::~Prefetcher() {
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    stopping = true;
+  }
+  changed.notify_all();
+  worker.join();
+}
+
+void Prefetcher::request(const SigilScanner::Token &token,
+                         const std::string &dir) {
+  std::string k = key(token.direction, token.path, dir);
+  std::lock_guard<std::mutex> lock(mutex);
+  if (requested.insert(k).second) {
+    queue.push_back(std::move(k));
+    changed.notify_one();
+  }
+}
+
+std::optional<std::string>
+Prefetcher::take(char direction, std::string_view pattern,
+                 const std::string &dir) {
+  std::string k = key(direction, pattern, dir);
+  std::unique_lock<std::mutex> lock(mutex);
+  changed.wait(lock, [&] { return in_flight != k; });
+  auto queued = std::find(queue.begin(), queue.end(), k);
+  if (queued != queue.end()) {
+    queue.erase(queued);
+  }
+  auto it = results.find(k);
+  if (it == results.end()) {
+    return std::nullopt;
+  }
+  return it->second;
+}
+
+void Prefetcher::clear() {
+  std::lock_guard<std::mutex> lock(mutex);
+  queue.clear();
+  requested.clear();
+  results.clear();
+}
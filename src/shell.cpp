@@ -0,0 +1,1597 @@
+#include "tbsh.h"
+
+Shell::Shell(bool batch) : batch(batch), watch_indexes(!batch) {
+  // Before any thread is started, so that every one inherits the blocked
+  // signals.
+  initialize_job_control();
+  set_cwd(fs::current_path().string());
+  if (!batch) {
+    dir_history.open(state_file("dirs"));
+  }
+  // Add the initial directory to history
+  dir_history.add(cwd);
+  if (!batch) {
+    active = this;
+    initialize_readline();
+    initialize_history();
+    daemon = std::make_unique<DaemonClient>();
+  }
+}
+
+Shell::~Shell() {
+  global_stats.maybe_dump(true);
+  if (sigchld_fd >= 0) {
+    close(sigchld_fd);
+  }
+  if (interrupt_fd >= 0) {
+    close(interrupt_fd);
+  }
+}
+
+void Shell::initialize_readline() {
+  rl_attempted_completion_function = custom_completion;
+  rl_bind_key('\t', rl_complete);
+  rl_variable_bind("completion-ignore-case", "on");
+}
+
+void Shell::initialize_history() {
+  size_t cap = 10000;
+  if (const char *size = getenv("HISTSIZE")) {
+    char *end;
+    unsigned long value = strtoul(size, &end, 10);
+    if (*size && !*end && value > 0) {
+      cap = value;
+    }
+  }
+  history = std::make_unique<HistoryLog>(state_file("history"), cap);
+  history->load();
+}
+
+void Shell::initialize_job_control() {
+  sigset_t mask;
+  sigemptyset(&mask);
+  sigaddset(&mask, SIGCHLD);
+  sigprocmask(SIG_BLOCK, &mask, nullptr);
+  sigchld_fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+  if (sigchld_fd < 0) {
+    perror("signalfd failed");
+  }
+
+  interactive = !batch && isatty(STDIN_FILENO);
+  if (interactive) {
+    signal(SIGTSTP, SIG_IGN);
+    signal(SIGTTIN, SIG_IGN);
+    signal(SIGTTOU, SIG_IGN);
+    signal(SIGQUIT, SIG_IGN);
+    sigset_t interrupt;
+    sigemptyset(&interrupt);
+    sigaddset(&interrupt, SIGINT);
+    sigprocmask(SIG_BLOCK, &interrupt, nullptr);
+    interrupt_fd = signalfd(-1, &interrupt, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (interrupt_fd < 0) {
+      perror("signalfd failed");
+    }
+    setpgid(0, 0);
+    shell_pgid = getpgrp();
+    tcsetpgrp(STDIN_FILENO, shell_pgid);
+  }
+}
+
+sigset_t Shell::child_default_signals() {
+  sigset_t set;
+  sigemptyset(&set);
+  for (int sig : {SIGCHLD, SIGTSTP, SIGTTIN, SIGTTOU, SIGINT, SIGQUIT}) {
+    sigaddset(&set, sig);
+  }
+  return set;
+}
+
+char * *Shell::custom_completion(const char *text, int start, int end) {
+  Stats::Timed timed(global_stats, Stats::Timer::Completion);
+  rl_attempted_completion_over = 1;
+  if (start > 0 && rl_line_buffer[start - 1] == '>') {
+    // Ranked candidates share no common prefix with `text`, so instead of
+    // letting readline reduce them to one, the best goes in slot 0.
+    std::vector<std::string> ranked = active->fuzzy_complete(text);
+    if (!ranked.empty()) {
+      char **matches = static_cast<char **>(
+          malloc((ranked.size() + (ranked.size() > 1) + 1) *
+                 sizeof(char *)));
+      size_t n = 0;
+      if (ranked.size() > 1) {
+        matches[n++] = strdup(ranked[0].c_str());
+      }
+      for (const std::string &match : ranked) {
+        matches[n++] = strdup(match.c_str());
+      }
+      matches[n] = nullptr;
+      return matches;
+    }
+  }
+  pending_matches = active->complete(text, start);
+  return rl_completion_matches(text, next_match);
+}
+
+char *Shell::next_match(const char *, int state) {
+  static size_t index;
+  if (state == 0) {
+    index = 0;
+  }
+  return index < pending_matches.size()
+             ? strdup(pending_matches[index++].c_str())
+             : nullptr;
+}
+
+std::vector<std::string> Shell::complete(const std::string &text, int start) {
+  size_t before = start;
+  while (before > 0 && std::isblank(rl_line_buffer[before - 1])) {
+    before--;
+  }
+  bool command_position = before == 0 || rl_line_buffer[before - 1] == '|';
+  std::vector<std::string> result;
+
+  if (command_position && text.find('/') == std::string::npos) {
+    auto starts_with_text = [&](const std::string &name) {
+      return name.size() >= text.size() &&
+             std::equal(text.begin(), text.end(), name.begin(),
+                        [](char a, char b) {
+                          return std::tolower(a) == std::tolower(b);
+                        });
+    };
+    for (const auto &[name, func] : custom_commands) {
+      if (starts_with_text(name)) {
+        result.push_back(name);
+      }
+    }
+    for (const char *name : {"cd", "exit", "time"}) {
+      if (starts_with_text(name)) {
+        result.push_back(name);
+      }
+    }
+    for (const std::string &dir : path_cache.directories()) {
+      std::string abs_dir = dir[0] == '/' ? dir : cwd + "/" + dir;
+      for (const auto *entry : completion_cache.matches(abs_dir, text)) {
+        if (entry->is_executable_candidate &&
+            access((abs_dir + "/" + entry->name).c_str(), X_OK) == 0) {
+          result.push_back(entry->name);
+        }
+      }
+    }
+    std::sort(result.begin(), result.end());
+    result.erase(std::unique(result.begin(), result.end()), result.end());
+    return result;
+  }
+
+  size_t slash = text.rfind('/');
+  std::string dir_part =
+      slash == std::string::npos ? "" : text.substr(0, slash + 1);
+  std::string base = text.substr(dir_part.size());
+  std::string dir;
+  if (dir_part.empty()) {
+    dir = cwd;
+  } else if (dir_part[0] == '/') {
+    dir = dir_part;
+  } else if (dir_part.compare(0, 2, "~/") == 0 && getenv("HOME")) {
+    dir = getenv("HOME") + dir_part.substr(1);
+  } else {
+    dir = cwd + "/" + dir_part;
+  }
+  if (dir.size() > 1 && dir.back() == '/') {
+    dir.pop_back();
+  }
+
+  rl_filename_completion_desired = 1;
+  for (const auto *entry : completion_cache.matches(dir, base)) {
+    result.push_back(dir_part + entry->name);
+  }
+  return result;
+}
+
+std::vector<std::string> Shell::fuzzy_complete(const std::string &text) {
+  if (daemon) {
+    if (auto remote = daemon->complete(text, cwd)) {
+      return *remote;
+    }
+  }
+  return fuzzy_complete_local(text, cwd);
+}
+
+std::vector<std::string>
+Shell::fuzzy_complete_local(const std::string &text, const std::string &dir) {
+  std::vector<std::string> result;
+  std::lock_guard<std::mutex> lock(resolve_mutex);
+  Project *project = text.empty() ? nullptr : index_for(dir);
+  if (!project) {
+    return result;
+  }
+  FileIndex *index = project->index.get();
+  std::string scope = index_scope(*index, dir);
+  size_t skip = scope.empty() ? 0 : scope.size() + 1;
+  for (auto &match : index->fuzzy_find(text, scope, fuzzy_candidates)) {
+    result.push_back(match.path.substr(skip));
+  }
+  return result;
+}
+
+std::string Shell::upfind(const std::string &dir_name, fs::path start) {
+  Stats::Timed timed(global_stats, Stats::Timer::Upfind);
+  std::string from = fs::absolute(start).string();
+  while (from.size() > 1 && from.back() == '/') {
+    from.pop_back();
+  }
+
+  StatxBatch *batch = nullptr;
+  if (upfind_backend == UpfindBackend::IoUring ||
+      upfind_backend == UpfindBackend::Threads ||
+      (upfind_backend == UpfindBackend::Auto &&
+       upfind_cache.on_remote_filesystem(from))) {
+    batch = &upfind_batch;
+  }
+  auto found = upfind_cache.nearest(
+      from, dir_name, batch, upfind_backend != UpfindBackend::Threads);
+  if (!found) {
+    throw std::runtime_error("Directory '" + dir_name +
+                             "' not found upwards from " + start.string());
+  }
+  return (fs::path(*found) / dir_name).string();
+}
+
+std::string Shell::downfind(const std::string &target_pattern, fs::path start,
+                            size_t limit) {
+  bool limit_hit = false;
+  auto found = downfind_all({target_pattern}, start, limit, &limit_hit);
+  if (!found[0]) {
+    throw not_found(target_pattern, limit_hit);
+  }
+  return *found[0];
+}
+
+std::runtime_error
+Shell::not_found(const std::string &pattern, bool limit_hit) {
+  return std::runtime_error(limit_hit
+                                ? "Search limit reached, target not found."
+                                : "Target '" + pattern + "' not found.");
+}
+
+std::vector<std::optional<std::string>>
+Shell::downfind_all(const std::vector<std::string> &patterns, fs::path start,
+                    size_t limit, bool *limit_hit) {
+  std::vector<std::optional<std::string>> found(patterns.size());
+  size_t unmatched = patterns.size();
+  std::string path = fs::absolute(start).native();
+  while (path.size() > 1 && path.back() == '/') {
+    path.pop_back();
+  }
+  int root_fd = ::open(path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (root_fd < 0) {
+    throw std::runtime_error("Cannot open " + path + ": " + strerror(errno));
+  }
+  IgnoreRules::LayerPtr top_layer = ignore_rules.above(path);
+  if (path.back() != '/') {
+    path += '/';
+  }
+  const size_t prefix_len = path.size();
+
+  // Directories still to visit, as NUL-terminated relative paths packed
+  // into `pending`, oldest first.
+  struct Dir {
+    size_t offset;
+    IgnoreRules::LayerPtr layer;
+  };
+  std::string pending(1, '\0');
+  std::queue<Dir> directories;
+  directories.push({0, top_layer});
+
+  // Names of the subdirectories of the directory being read.
+  std::string subdir_names;
+  std::vector<size_t> subdirs;
+  alignas(linux_dirent64) char buffer[32 * 1024];
+  size_t search_count = 0;
+
+  while (!directories.empty() && search_count < limit) {
+    Dir dir = std::move(directories.front());
+    directories.pop();
+    const char *rel_dir = pending.c_str() + dir.offset;
+    path.resize(prefix_len);
+    path += rel_dir;
+    if (*rel_dir) {
+      path += '/';
+    }
+    const size_t dir_len = path.size();
+
+    int fd = openat(root_fd, *rel_dir ? rel_dir : ".",
+                    O_RDONLY | O_DIRECTORY | O_CLOEXEC | O_NOFOLLOW);
+    if (fd < 0) {
+      continue;
+    }
+    subdir_names.clear();
+    subdirs.clear();
+    bool has_gitignore = false, has_ignore = false;
+    long len;
+    while ((len = syscall(SYS_getdents64, fd, buffer, sizeof(buffer))) > 0) {
+      for (long pos = 0; pos < len;) {
+        auto *entry = reinterpret_cast<linux_dirent64 *>(buffer + pos);
+        pos += entry->d_reclen;
+        const char *name = entry->d_name;
+        if (name[0] == '.' &&
+            (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'))) {
+          continue;
+        }
+
+        unsigned char type = entry->d_type;
+        if (type == DT_UNKNOWN) {
+          struct stat st;
+          if (fstatat(fd, name, &st, AT_SYMLINK_NOFOLLOW) == 0) {
+            type = S_ISDIR(st.st_mode) ? DT_DIR : DT_REG;
+          }
+        }
+
+        if (type == DT_DIR) {
+          subdirs.push_back(subdir_names.size());
+          subdir_names += name;
+          subdir_names += '\0';
+        } else {
+          has_gitignore |= std::strcmp(name, ".gitignore") == 0;
+          has_ignore |= std::strcmp(name, ".ignore") == 0;
+          path.resize(dir_len);
+          path += name;
+          std::string_view rel_path =
+              std::string_view(path).substr(prefix_len);
+          for (size_t i = 0; i < patterns.size(); i++) {
+            const std::string &pattern = patterns[i];
+            if (trace) {
+              std::cerr << rel_path << " | " << pattern << '\n';
+            }
+            if (!found[i] && rel_path.size() >= pattern.size() &&
+                rel_path.compare(rel_path.size() - pattern.size(),
+                                 pattern.size(), pattern) == 0) {
+              found[i] = path;
+              unmatched--;
+            }
+          }
+          if (unmatched == 0) {
+            close(fd);
+            close(root_fd);
+            return found;
+          }
+        }
+
+        search_count++;
+        if (search_count >= limit) {
+          close(fd);
+          close(root_fd);
+          if (limit_hit) {
+            *limit_hit = true;
+          }
+          return found;
+        }
+      }
+    }
+    close(fd);
+
+    path.resize(dir_len);
+    auto layer = ignore_rules.enter(dir.layer, path.substr(0, dir_len - 1),
+                                    has_gitignore, has_ignore);
+    for (size_t offset : subdirs) {
+      const char *name = subdir_names.c_str() + offset;
+      path.resize(dir_len);
+      path += name;
+      if (ignore_rules.skip(layer.get(), name, path, patterns)) {
+        if (trace) {
+          std::cerr << "[skip] " << path.substr(prefix_len) << '\n';
+        }
+        continue;
+      }
+      size_t next = pending.size();
+      pending.append(path, prefix_len);
+      pending += '\0';
+      directories.push({next, layer});
+    }
+  }
+
+  close(root_fd);
+  return found;
+}
+
+Shell::Project *Shell::index_for(const fs::path &start) {
+  fs::path root;
+  try {
+    root = fs::path(upfind(".git", start)).parent_path();
+  } catch (const std::exception &) {
+    return nullptr;
+  }
+  auto it = std::find_if(projects.begin(), projects.end(),
+                         [&](const Project &project) {
+                           return project.index->root() == root;
+                         });
+  if (it != projects.end()) {
+    projects.splice(projects.begin(), projects, it);
+    return &projects.front();
+  }
+
+  while (!projects.empty() && projects.size() >= max_projects) {
+    projects.pop_back();
+  }
+  Project project;
+  project.index = std::make_unique<FileIndex>(root);
+  project.index->open(ignore_rules);
+  try {
+    if (watch_indexes) {
+      project.watcher =
+          std::make_unique<IndexWatcher>(*project.index, ignore_rules);
+    }
+  } catch (const std::exception &e) {
+    std::cerr << "[index watcher] " << e.what() << std::endl;
+  }
+  projects.push_front(std::move(project));
+  return &projects.front();
+}
+
+std::string
+Shell::indexed_downfind(const std::string &target_pattern, fs::path start) {
+  Stats::Timed timed(global_stats, Stats::Timer::Downfind);
+  start = fs::absolute(start);
+  Project *project = index_for(start);
+  if (!project) {
+    return downfind_threads > 1 ? parallel_downfind(target_pattern, start)
+                                : downfind(target_pattern, start);
+  }
+
+  FileIndex *index = project->index.get();
+  std::string root = index->root().string();
+  std::string scope = index_scope(*index, start);
+
+  bool live = project->watcher && project->watcher->ready();
+  while (auto rel = index->find_suffix(target_pattern, scope)) {
+    fs::path candidate = index->root() / *rel;
+    if (live || fs::exists(candidate)) {
+      global_stats.count(Stats::Cache::Index, true);
+      return candidate.string();
+    }
+    index->remove(*rel);
+  }
+  global_stats.count(Stats::Cache::Index, false);
+  // The index leaves out pruned directories, which a pattern naming one
+  // (`>build/out.log`) still reaches through the walk; what that finds is
+  // kept out of the index too.
+  bool names_dir = target_pattern.find('/') != std::string::npos;
+  if (!live || names_dir) {
+    try {
+      std::string found = downfind(target_pattern, start);
+      if (!names_dir) {
+        index->add(found.substr(root.size() + 1));
+      }
+      return found;
+    } catch (const std::exception &) {
+    }
+  }
+  throw std::runtime_error("Target '" + target_pattern + "' not found.");
+}
+
+fs::path Shell::state_file(const char *name) {
+  const char *state = getenv("XDG_STATE_HOME");
+  const char *home = getenv("HOME");
+  fs::path dir = state ? fs::path(state) / "tbsh"
+                       : fs::path(home ? home : "/tmp") / ".local" /
+                             "state" / "tbsh";
+  return dir / name;
+}
+
+std::string Shell::index_scope(const FileIndex &index, const fs::path &dir) {
+  std::string root = index.root().string();
+  std::string path = dir.string();
+  return path.size() > root.size() ? path.substr(root.size() + 1)
+                                   : std::string();
+}
+
+void Shell::reindex(fs::path start) {
+  std::lock_guard<std::mutex> lock(resolve_mutex);
+  Project *project = index_for(fs::absolute(start));
+  if (!project) {
+    throw std::runtime_error("No project root (.git) above " +
+                             start.string());
+  }
+  project->index->rebuild(ignore_rules);
+}
+
+std::string Shell::parallel_downfind(const std::string &target_pattern,
+                                     fs::path start, size_t limit) {
+  bool limit_hit = false;
+  auto found =
+      parallel_downfind_all({target_pattern}, start, limit, &limit_hit);
+  if (!found[0]) {
+    throw not_found(target_pattern, limit_hit);
+  }
+  return *found[0];
+}
+
+std::vector<std::optional<std::string>>
+Shell::parallel_downfind_all(const std::vector<std::string> &patterns,
+                             fs::path start, size_t limit, bool *limit_hit) {
+  auto found = walker.search(patterns, fs::absolute(start), limit,
+                             downfind_threads, &ignore_rules);
+  if (limit_hit) {
+    *limit_hit = walker.limit_reached();
+  }
+  return found;
+}
+
+std::optional<std::string>
+Shell::speculate(char direction, const std::string &pattern,
+                 const std::string &dir) {
+  try {
+    return resolve_token(direction, pattern, dir);
+  } catch (const std::exception &) {
+    return std::nullopt;
+  }
+}
+
+std::string Shell::resolve_token(char direction, const std::string &pattern,
+                                 const std::string &dir) {
+  std::vector<Resolution> batch{{direction, pattern, false, {}}};
+  resolve_tokens(batch, dir);
+  Resolution &token = batch.front();
+  if (!token.found) {
+    throw std::runtime_error(token.text);
+  }
+  return token.text;
+}
+
+void Shell::resolve_tokens(std::vector<Resolution> &batch,
+                           const std::string &dir) {
+  if (daemon) {
+    bool answered = daemon->resolve(batch, dir);
+    global_stats.count(Stats::Cache::Daemon, answered);
+    if (answered) {
+      return;
+    }
+  }
+  std::lock_guard<std::mutex> lock(resolve_mutex);
+  resolve_tokens_locked(batch, dir);
+}
+
+void Shell::resolve_tokens_locked(std::vector<Resolution> &batch,
+                                  const std::string &dir) {
+  upfind_cache.next_epoch();
+  fs::path start = fs::absolute(dir);
+  bool indexed = std::any_of(batch.begin(), batch.end(),
+                             [](const Resolution &token) {
+                               return token.direction == '>';
+                             }) &&
+                 index_for(start);
+  std::vector<std::string> patterns;
+  std::vector<Resolution *> walked;
+  for (auto &token : batch) {
+    if (token.direction == '>' && !indexed) {
+      patterns.push_back(token.pattern);
+      walked.push_back(&token);
+      continue;
+    }
+    try {
+      token.text = token.direction == '<'
+                       ? upfind(token.pattern, start)
+                       : indexed_downfind(token.pattern, start);
+      token.found = true;
+    } catch (const std::exception &e) {
+      token.text = e.what();
+    }
+  }
+  if (patterns.empty()) {
+    return;
+  }
+
+  try {
+    Stats::Timed timed(global_stats, Stats::Timer::Downfind);
+    bool limit_hit = false;
+    auto found =
+        downfind_threads > 1
+            ? parallel_downfind_all(patterns, start, 1000, &limit_hit)
+            : downfind_all(patterns, start, 1000, &limit_hit);
+    for (size_t i = 0; i < walked.size(); i++) {
+      walked[i]->found = found[i].has_value();
+      walked[i]->text = found[i] ? *found[i]
+                                 : not_found(patterns[i], limit_hit).what();
+    }
+  } catch (const std::exception &e) {
+    for (Resolution *token : walked) {
+      token->text = e.what();
+    }
+  }
+}
+
+bool Shell::prefetch_tokens(bool paused) {
+  bool waiting = false;
+  SigilScanner scanner(std::string_view(rl_line_buffer, rl_end));
+  while (auto token = scanner.next()) {
+    size_t end = token->pos + token->length();
+    if (rl_point > static_cast<int>(token->pos) &&
+        rl_point <= static_cast<int>(end) && !paused) {
+      waiting = true;
+    } else {
+      prefetcher->request(*token, cwd);
+    }
+  }
+  return waiting;
+}
+
+std::pmr::string Shell::transform_command(std::string_view command,
+                                          std::pmr::memory_resource *memory) {
+  Stats::Timed timed(global_stats, Stats::Timer::Transform);
+  SigilScanner scanner(command);
+  std::pmr::vector<SigilScanner::Token> matches(memory);
+  std::vector<Resolution> tokens;
+  while (auto match = scanner.next()) {
+    matches.push_back(*match);
+    tokens.push_back(
+        {match->direction, std::string(match->path), false, {}});
+  }
+  if (matches.empty()) {
+    if (prefetcher) {
+      prefetcher->clear();
+    }
+    return std::pmr::string(command, memory);
+  }
+
+  // Take what the prefetcher already knows, and resolve the rest of the
+  // line at once, so that its tokens can share a walk.
+  std::vector<Resolution> pending;
+  std::vector<size_t> pending_index;
+  for (size_t i = 0; i < tokens.size(); i++) {
+    std::optional<std::string> found_path;
+    std::error_code ec;
+    if (prefetcher) {
+      found_path = prefetcher->take(tokens[i].direction, tokens[i].pattern,
+                                    cwd);
+      if (found_path && !fs::exists(*found_path, ec)) {
+        found_path.reset();
+      }
+      global_stats.count(Stats::Cache::Prefetch, found_path.has_value());
+    }
+    if (found_path) {
+      tokens[i].found = true;
+      tokens[i].text = std::move(*found_path);
+    } else {
+      pending.push_back(tokens[i]);
+      pending_index.push_back(i);
+    }
+  }
+  if (!pending.empty()) {
+    resolve_tokens(pending, cwd);
+    for (size_t i = 0; i < pending.size(); i++) {
+      tokens[pending_index[i]] = std::move(pending[i]);
+    }
+  }
+
+  std::pmr::string result(memory);
+  result.reserve(command.size());
+  size_t last_pos = 0;
+  for (size_t i = 0; i < matches.size(); i++) {
+    const SigilScanner::Token &match = matches[i];
+    // Append text before the match
+    result.append(command, last_pos, match.pos - last_pos);
+    if (tokens[i].found) {
+      SigilScanner::append_quoted(result, tokens[i].text);
+    } else {
+      std::cerr << "[find error] " << tokens[i].text << std::endl;
+      // If not found, keep original text
+      result.append(command, match.pos, match.length());
+    }
+    last_pos = match.pos + match.length();
+  }
+
+  // Append remainder of the string
+  result.append(command, last_pos);
+  if (prefetcher) {
+    prefetcher->clear();
+  }
+  return result;
+}
+
+void Shell::set_cwd(std::string path) {
+  cwd = std::move(path);
+  prompt_text = "tbsh:" + cwd + "$ ";
+}
+
+std::string Shell::resolve_chdir(const char *path) const {
+  fs::path target(path);
+  bool climbs = false;
+  for (const fs::path &part : target) {
+    climbs |= part == "..";
+  }
+  if (climbs) {
+    return fs::current_path().string();
+  }
+  fs::path resolved =
+      (target.is_absolute() ? target : fs::path(cwd) / target)
+          .lexically_normal();
+  std::string result = resolved.string();
+  if (result.size() > 1 && result.back() == '/') {
+    result.pop_back();
+  }
+  return result;
+}
+
+bool Shell::change_directory(const char *path, bool update_history) {
+  if (chdir(path) == 0) {
+    set_cwd(resolve_chdir(path));
+    std::lock_guard<std::mutex> lock(resolve_mutex);
+    upfind_cache.retain_chain(cwd);
+    if (update_history) {
+      dir_history.add(cwd);
+    } else {
+      dir_history.visit(cwd);
+    }
+    return true;
+  }
+  perror("chdir failed");
+  return false;
+}
+
+pid_t Shell::launch(char *const argv[], const ChildSetup &setup) {
+  Stats::Timed timed(global_stats, Stats::Timer::Spawn);
+  std::string name = argv[0];
+  for (int attempt = 0; attempt < 2; attempt++) {
+    std::optional<std::string> path = path_cache.lookup(name);
+    if (!path) {
+      std::cerr << name << ": command not found" << std::endl;
+      errno = ENOENT;
+      return -1;
+    }
+
+    if (launch_backend == LaunchBackend::Spawn) {
+      posix_spawn_file_actions_t actions;
+      posix_spawn_file_actions_init(&actions);
+      if (setup.in_fd >= 0) {
+        posix_spawn_file_actions_adddup2(&actions, setup.in_fd, STDIN_FILENO);
+      }
+      if (setup.out_fd >= 0) {
+        posix_spawn_file_actions_adddup2(&actions, setup.out_fd,
+                                         STDOUT_FILENO);
+      }
+      if (setup.err_fd >= 0) {
+        posix_spawn_file_actions_adddup2(&actions, setup.err_fd,
+                                         STDERR_FILENO);
+      }
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || __GLIBC_MINOR__ >= 35)
+      if (setup.foreground && interactive) {
+        posix_spawn_file_actions_addtcsetpgrp_np(&actions, STDIN_FILENO);
+      }
+#endif
+
+      posix_spawnattr_t attr;
+      posix_spawnattr_init(&attr);
+      short flags = POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF;
+      if (interactive) {
+        flags |= POSIX_SPAWN_SETPGROUP;
+        posix_spawnattr_setpgroup(&attr, setup.pgid);
+      }
+      posix_spawnattr_setflags(&attr, flags);
+      sigset_t no_signals, default_signals = child_default_signals();
+      sigemptyset(&no_signals);
+      posix_spawnattr_setsigmask(&attr, &no_signals);
+      posix_spawnattr_setsigdefault(&attr, &default_signals);
+
+      pid_t pid;
+      int rc =
+          posix_spawn(&pid, path->c_str(), &actions, &attr, argv, environ);
+      posix_spawn_file_actions_destroy(&actions);
+      posix_spawnattr_destroy(&attr);
+      if (rc == 0) {
+        return pid;
+      }
+      if (rc == ENOENT && attempt == 0) {
+        path_cache.forget(name);
+        continue;
+      }
+      if (rc == ENOENT || rc == EACCES || rc == ENOEXEC || rc == ENOTDIR ||
+          rc == ELOOP || rc == ENAMETOOLONG) {
+        std::cerr << name << ": " << strerror(rc) << std::endl;
+        errno = rc;
+        return -1;
+      }
+    }
+
+    pid_t pid = fork_child(setup);
+    if (pid == 0) {
+      execv(path->c_str(), argv);
+      perror("execv failed");
+      _exit(EXIT_FAILURE);
+    }
+    return pid;
+  }
+  return -1;
+}
+
+pid_t Shell::fork_child(const ChildSetup &setup) {
+  std::cout.flush();
+  pid_t pid = fork();
+  if (pid < 0) {
+    perror("fork failed");
+    return pid;
+  }
+  if (pid > 0) {
+    // Also done by the child; whichever runs first wins the race.
+    if (interactive) {
+      setpgid(pid, setup.pgid ? setup.pgid : pid);
+    }
+    return pid;
+  }
+
+  if (interactive) {
+    setpgid(0, setup.pgid);
+    if (setup.foreground) {
+      tcsetpgrp(STDIN_FILENO, getpgrp());
+    }
+  }
+  sigset_t defaults = child_default_signals();
+  for (int sig = 1; sig < NSIG; sig++) {
+    if (sigismember(&defaults, sig) == 1) {
+      signal(sig, SIG_DFL);
+    }
+  }
+  sigset_t no_signals;
+  sigemptyset(&no_signals);
+  sigprocmask(SIG_SETMASK, &no_signals, nullptr);
+
+  if (setup.in_fd >= 0 && dup2(setup.in_fd, STDIN_FILENO) < 0) {
+    perror("dup2 failed");
+    _exit(EXIT_FAILURE);
+  }
+  if (setup.out_fd >= 0 && dup2(setup.out_fd, STDOUT_FILENO) < 0) {
+    perror("dup2 failed");
+    _exit(EXIT_FAILURE);
+  }
+  if (setup.err_fd >= 0 && dup2(setup.err_fd, STDERR_FILENO) < 0) {
+    perror("dup2 failed");
+    _exit(EXIT_FAILURE);
+  }
+  return 0;
+}
+
+int Shell::open_redirect(const char *path, int flags) {
+  int fd = ::open(path, flags | O_CLOEXEC, 0666);
+  if (fd < 0) {
+    std::cerr << "tbsh: " << path << ": " << strerror(errno) << std::endl;
+  }
+  return fd;
+}
+
+int Shell::output_flags(const CommandLine::Stage &stage) {
+  return O_WRONLY | O_CREAT | (stage.append ? O_APPEND : O_TRUNC);
+}
+
+bool Shell::is_builtin(const std::string &name) const {
+  return name == "cd" || custom_commands.count(name);
+}
+
+bool Shell::runs_in_shell(const CommandLine::Stage &stage) const {
+  std::string command(stage.args[0]);
+  if (is_builtin(command)) {
+    return true;
+  }
+  auto fast = fast_commands.find(command);
+  if (fast == fast_commands.end()) {
+    return false;
+  }
+  // accepts() sees the shell's own standard input. Reading a redirected
+  // one that is not a file could block where ^C cannot reach it.
+  struct stat in;
+  if (stage.input &&
+      (stat(stage.input, &in) != 0 || !S_ISREG(in.st_mode))) {
+    return false;
+  }
+  return fast->second.accepts(stage.args);
+}
+
+int Shell::run_builtin(CommandLine::Stage &stage) {
+  std::string command(stage.args[0]);
+
+  if (command == "cd") {
+    const char *path = stage.args.size() > 1 ? stage.argv[1] : getenv("HOME");
+    if (!path)
+      path = "/";
+    if (!change_directory(path)) {
+      return EXIT_FAILURE;
+    }
+    std::cout << "Changed directory to: " << dir_history.current()
+              << std::endl;
+    return EXIT_SUCCESS;
+  }
+
+  auto custom = custom_commands.find(command);
+  if (custom == custom_commands.end()) {
+    std::cout.flush();
+    return fast_commands.at(command).run(stage.args);
+  }
+  try {
+    custom->second(stage.args);
+  } catch (const std::exception &e) {
+    std::cerr << "Error: " << e.what() << std::endl;
+    return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}
+
+int Shell::run_builtin_redirected(CommandLine::Stage &stage) {
+  int saved_in = -1, saved_out = -1;
+  int status = EXIT_FAILURE;
+  if (stage.input) {
+    int fd = open_redirect(stage.input, O_RDONLY);
+    if (fd < 0) {
+      return EXIT_FAILURE;
+    }
+    saved_in = fcntl(STDIN_FILENO, F_DUPFD_CLOEXEC, 10);
+    dup2(fd, STDIN_FILENO);
+    close(fd);
+  }
+  int out_fd = -1;
+  if (stage.output) {
+    out_fd = open_redirect(stage.output, output_flags(stage));
+    if (out_fd >= 0) {
+      std::cout.flush();
+      saved_out = fcntl(STDOUT_FILENO, F_DUPFD_CLOEXEC, 10);
+      dup2(out_fd, STDOUT_FILENO);
+      close(out_fd);
+    }
+  }
+  if (!stage.output || out_fd >= 0) {
+    status = run_builtin(stage);
+  }
+
+  std::cout.flush();
+  if (saved_in >= 0) {
+    dup2(saved_in, STDIN_FILENO);
+    close(saved_in);
+  }
+  if (saved_out >= 0) {
+    dup2(saved_out, STDOUT_FILENO);
+    close(saved_out);
+  }
+  return status;
+}
+
+pid_t Shell::fork_builtin(CommandLine::Stage &stage, const ChildSetup &setup) {
+  pid_t pid = fork_child(setup);
+  if (pid == 0) {
+    int status = run_builtin(stage);
+    std::cout.flush();
+    _exit(status);
+  }
+  return pid;
+}
+
+int Shell::run_pipeline(std::vector<CommandLine::Stage> &stages,
+                        std::string_view command, bool background,
+                        LineTiming *timing) {
+  auto started_at = std::chrono::steady_clock::now();
+  std::vector<pid_t> pids;
+  pids.reserve(stages.size());
+  pid_t pgid = 0;
+  int next_in = -1;
+  int failure = EXIT_SUCCESS; // why the last stage did not start, if not
+
+  for (size_t i = 0; i < stages.size(); i++) {
+    CommandLine::Stage &stage = stages[i];
+    int in_fd = next_in, out_fd = -1;
+    next_in = -1;
+    if (i + 1 < stages.size()) {
+      int fds[2];
+      if (pipe2(fds, O_CLOEXEC) != 0) {
+        perror("pipe failed");
+        if (in_fd >= 0) {
+          close(in_fd);
+        }
+        failure = EXIT_FAILURE;
+        break;
+      }
+      next_in = fds[0];
+      out_fd = fds[1];
+    }
+
+    bool ready = true;
+    failure = EXIT_FAILURE;
+    if (stage.input) {
+      if (in_fd >= 0) {
+        close(in_fd);
+      }
+      in_fd = open_redirect(stage.input, O_RDONLY);
+      ready = in_fd >= 0;
+    }
+    if (ready && stage.output) {
+      if (out_fd >= 0) {
+        close(out_fd);
+      }
+      out_fd = open_redirect(stage.output, output_flags(stage));
+      ready = out_fd >= 0;
+    }
+
+    if (ready) {
+      ChildSetup setup{in_fd, out_fd, pgid, !background};
+      pid_t pid = runs_in_shell(stage) ? fork_builtin(stage, setup)
+                                       : launch(stage.argv.data(), setup);
+      if (pid > 0) {
+        failure = EXIT_SUCCESS;
+        pids.push_back(pid);
+        if (!pgid) {
+          pgid = pid;
+        }
+      } else {
+        failure = errno == ENOENT ? 127 : 126;
+      }
+    }
+    if (in_fd >= 0) {
+      close(in_fd);
+    }
+    if (out_fd >= 0) {
+      close(out_fd);
+    }
+  }
+
+  auto launched_at = std::chrono::steady_clock::now();
+  if (timing) {
+    timing->spawn = launched_at - started_at;
+  }
+  if (pids.empty()) {
+    return background ? EXIT_SUCCESS : failure;
+  }
+  JobTable::Job &job =
+      jobs.add(pgid, std::move(pids), std::string(command));
+  if (background) {
+    std::cout << "[" << job.id << "] " << job.pgid << std::endl;
+    return EXIT_SUCCESS;
+  }
+  int status = wait_job(job, true, timing ? &timing->usage : nullptr);
+  if (timing) {
+    timing->real = std::chrono::steady_clock::now() - started_at;
+    timing->waited = true;
+  }
+  return failure != EXIT_SUCCESS ? failure : status;
+}
+
+void Shell::report_timing(const LineTiming &timing) {
+  auto ms = [](std::chrono::steady_clock::duration d) {
+    return std::chrono::duration<double, std::milli>(d).count();
+  };
+  auto tv_ms = [](const struct timeval &tv) {
+    return tv.tv_sec * 1e3 + tv.tv_usec / 1e3;
+  };
+  char line[256];
+  if (timing.waited) {
+    const struct rusage &u = timing.usage;
+    snprintf(line, sizeof(line),
+             "[time] real %.3fms user %.3fms sys %.3fms maxrss %ldKB "
+             "csw %ld/%ld",
+             ms(timing.real), tv_ms(u.ru_utime), tv_ms(u.ru_stime),
+             u.ru_maxrss, u.ru_nvcsw, u.ru_nivcsw);
+    std::cerr << line << std::endl;
+  }
+  snprintf(line, sizeof(line),
+           "[time] tbsh: transform %.3fms parse %.3fms %s %.3fms",
+           ms(timing.transform), ms(timing.parse),
+           timing.builtin ? "builtin" : "spawn", ms(timing.spawn));
+  std::cerr << line << std::endl;
+}
+
+int Shell::exit_status(int status) {
+  if (WIFSIGNALED(status)) {
+    return 128 + WTERMSIG(status);
+  }
+  if (WIFSTOPPED(status)) {
+    return 128 + WSTOPSIG(status);
+  }
+  return WEXITSTATUS(status);
+}
+
+pid_t Shell::wait_stage(JobTable::Job &job, int &status, struct rusage &usage) {
+  if (interactive) {
+    return wait4(-job.pgid, &status, WUNTRACED, &usage);
+  }
+  for (pid_t pid : job.pids) {
+    pid_t changed = wait4(pid, &status, WUNTRACED, &usage);
+    if (changed > 0 || errno != ECHILD) {
+      return changed;
+    }
+  }
+  return -1;
+}
+
+void Shell::signal_job(const JobTable::Job &job, int sig) {
+  if (interactive) {
+    kill(-job.pgid, sig);
+    return;
+  }
+  for (pid_t pid : job.pids) {
+    kill(pid, sig);
+  }
+}
+
+int Shell::wait_job(JobTable::Job &job, bool foreground, struct rusage *usage) {
+  if (foreground && interactive) {
+    tcsetpgrp(STDIN_FILENO, job.pgid);
+  }
+  while (job.state == JobTable::State::Running) {
+    int status;
+    struct rusage child;
+    pid_t pid = wait_stage(job, status, child);
+    if (pid < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      job.state = JobTable::State::Done;
+      break;
+    }
+    jobs.update(pid, status, child);
+  }
+  if (foreground && interactive) {
+    tcsetpgrp(STDIN_FILENO, shell_pgid);
+  }
+  if (usage) {
+    *usage = job.usage;
+  }
+
+  int status = exit_status(job.status);
+  if (job.state == JobTable::State::Stopped) {
+    std::cout << std::endl;
+    jobs.report(std::cout, true);
+  } else if (foreground) {
+    jobs.remove(job.id);
+  }
+  return status;
+}
+
+void Shell::reap_jobs() {
+  struct signalfd_siginfo info;
+  while (sigchld_fd >= 0 && read(sigchld_fd, &info, sizeof(info)) > 0) {
+  }
+  int status;
+  struct rusage usage;
+  pid_t pid;
+  while ((pid = wait4(-1, &status, WNOHANG | WUNTRACED | WCONTINUED,
+                      &usage)) > 0) {
+    jobs.update(pid, status, usage);
+  }
+}
+
+bool Shell::take_interrupt() {
+  struct signalfd_siginfo info;
+  bool interrupted = false;
+  while (interrupt_fd >= 0 && read(interrupt_fd, &info, sizeof(info)) > 0) {
+    interrupted = true;
+  }
+  return interrupted;
+}
+
+JobTable::Job &Shell::find_job(std::string_view spec) {
+  JobTable::Job *job = jobs.find(spec);
+  if (!job) {
+    throw std::runtime_error(spec.empty() ? std::string("no current job")
+                                          : std::string(spec) +
+                                                ": no such job");
+  }
+  return *job;
+}
+
+void Shell::foreground_job(std::string_view spec) {
+  JobTable::Job &job = find_job(spec);
+  std::cout << job.command << std::endl;
+  job.state = JobTable::State::Running;
+  signal_job(job, SIGCONT);
+  wait_job(job, true);
+}
+
+void Shell::background_job(std::string_view spec) {
+  JobTable::Job &job = find_job(spec);
+  job.state = JobTable::State::Running;
+  signal_job(job, SIGCONT);
+  std::cout << "[" << job.id << "]+ " << job.command << " &" << std::endl;
+}
+
+void Shell::wait_jobs(std::string_view spec) {
+  if (!spec.empty()) {
+    wait_job(find_job(spec), false);
+  } else {
+    for (int id : jobs.ids()) {
+      JobTable::Job &job = *jobs.find(std::to_string(id));
+      if (job.state == JobTable::State::Running) {
+        wait_job(job, false);
+      }
+    }
+  }
+  jobs.report(std::cout, true);
+}
+
+void Shell::add_custom_command(
+    const std::string &name,
+    std::function<void(std::vector<std::string_view> &)> func) {
+  custom_commands[name] = func;
+}
+
+void Shell::add_fast_command(const std::string &name, FastCommand command) {
+  fast_commands[name] = std::move(command);
+}
+
+void Shell::run_parallel(const std::vector<std::string_view> &args) {
+  size_t limit = std::max(1u, std::thread::hardware_concurrency());
+  size_t i = 1;
+  if (i + 1 < args.size() && args[i] == "-j") {
+    limit = std::max(1, std::atoi(std::string(args[i + 1]).c_str()));
+    i += 2;
+  }
+  auto separator = std::find(args.begin() + i, args.end(), ":::");
+  std::vector<std::string_view> command(args.begin() + i, separator);
+  if (command.empty() || separator == args.end()) {
+    throw std::runtime_error("usage: par [-j N] cmd [args...] ::: items...");
+  }
+  std::vector<std::string_view> items(separator + 1, args.end());
+  bool has_placeholder = std::any_of(
+      command.begin(), command.end(),
+      [](std::string_view arg) { return arg.find("{}") != arg.npos; });
+
+  struct Running {
+    pid_t pid;
+    int fd;
+    std::string pending;
+  };
+  std::vector<Running> running;
+
+  int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  int null_fd = ::open("/dev/null", O_RDONLY | O_CLOEXEC);
+  if (epoll_fd < 0 || null_fd < 0) {
+    throw std::runtime_error(std::string("par: ") + strerror(errno));
+  }
+  if (interrupt_fd >= 0) {
+    take_interrupt();
+    struct epoll_event event = {};
+    event.events = EPOLLIN;
+    event.data.fd = interrupt_fd;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, interrupt_fd, &event);
+  }
+
+  auto start = [&](std::string_view item) {
+    std::vector<std::string> words;
+    for (std::string_view arg : command) {
+      std::string word(arg);
+      for (size_t at = word.find("{}"); at != std::string::npos;
+           at = word.find("{}", at + item.size())) {
+        word.replace(at, 2, item);
+      }
+      words.push_back(std::move(word));
+    }
+    if (!has_placeholder) {
+      words.emplace_back(item);
+    }
+    std::vector<char *> argv;
+    for (std::string &word : words) {
+      argv.push_back(word.data());
+    }
+    argv.push_back(nullptr);
+
+    int fds[2];
+    if (pipe2(fds, O_CLOEXEC) != 0) {
+      perror("pipe failed");
+      return false;
+    }
+    ChildSetup setup{null_fd, fds[1], 0, false, fds[1]};
+    pid_t pid = launch(argv.data(), setup);
+    close(fds[1]);
+    if (pid < 0) {
+      close(fds[0]);
+      return false;
+    }
+    struct epoll_event event = {};
+    event.events = EPOLLIN;
+    event.data.fd = fds[0];
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fds[0], &event);
+    running.push_back({pid, fds[0], {}});
+    return true;
+  };
+
+  auto write_out = [](std::string_view text) {
+    while (!text.empty()) {
+      ssize_t n = write(STDOUT_FILENO, text.data(), text.size());
+      if (n <= 0) {
+        if (n < 0 && errno == EINTR) {
+          continue;
+        }
+        return;
+      }
+      text.remove_prefix(n);
+    }
+  };
+
+  std::cout.flush();
+  auto started_at = std::chrono::steady_clock::now();
+  size_t next = 0, failed = 0, dropped = 0;
+  char buffer[64 * 1024];
+
+  while (next < items.size() || !running.empty()) {
+    while (next < items.size() && running.size() < limit) {
+      if (!start(items[next++])) {
+        failed++;
+      }
+    }
+    if (running.empty()) {
+      continue;
+    }
+
+    struct epoll_event events[16];
+    int ready = epoll_wait(epoll_fd, events, 16, -1);
+    if (ready < 0 && errno != EINTR) {
+      perror("epoll_wait failed");
+      break;
+    }
+    for (int e = 0; e < ready; e++) {
+      if (events[e].data.fd == interrupt_fd) {
+        if (take_interrupt()) {
+          // Each job has a process group of its own, which the terminal
+          // does not send ^C to.
+          for (const Running &job : running) {
+            kill(-job.pid, SIGINT);
+          }
+          dropped += items.size() - next;
+          next = items.size();
+        }
+        continue;
+      }
+      auto job = std::find_if(running.begin(), running.end(),
+                              [&](const Running &r) {
+                                return r.fd == events[e].data.fd;
+                              });
+      ssize_t n = read(job->fd, buffer, sizeof(buffer));
+      if (n > 0) {
+        job->pending.append(buffer, n);
+        size_t end = job->pending.rfind('\n');
+        if (end != std::string::npos) {
+          write_out(std::string_view(job->pending).substr(0, end + 1));
+          job->pending.erase(0, end + 1);
+        }
+        continue;
+      }
+      if (n < 0 && (errno == EINTR || errno == EAGAIN)) {
+        continue;
+      }
+
+      write_out(job->pending);
+      epoll_ctl(epoll_fd, EPOLL_CTL_DEL, job->fd, nullptr);
+      close(job->fd);
+      int status = 0;
+      while (waitpid(job->pid, &status, 0) < 0 && errno == EINTR) {
+      }
+      if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        failed++;
+      }
+      running.erase(job);
+    }
+  }
+  close(epoll_fd);
+  close(null_fd);
+
+  double seconds = std::chrono::duration<double>(
+                       std::chrono::steady_clock::now() - started_at)
+                       .count();
+  std::cerr << "par: " << items.size() << " jobs, " << failed
+            << " failed, ";
+  if (dropped) {
+    std::cerr << dropped << " not started, ";
+  }
+  std::cerr << std::fixed << std::setprecision(3) << seconds
+            << "s wall" << std::defaultfloat << std::endl;
+}
+
+bool Shell::execute(std::string_view input_line) {
+  // What the last line took from the arena is all returned here, so the
+  // arena never holds more than one line's worth.
+  line_arena.release();
+  // A repeated line is not recorded again; a new one is the copy that
+  // every interactive line but those costs the heap.
+  if (!batch) {
+    HIST_ENTRY *last = history_length > 0 ? history_get(history_base +
+                                                        history_length - 1)
+                                          : nullptr;
+    if (!last || input_line != last->line) {
+      std::string line(input_line);
+      add_history(line.c_str());
+      history->append(std::move(line));
+    }
+  }
+
+  LineTiming timing;
+  auto mark = std::chrono::steady_clock::now();
+  auto lap = [&] {
+    auto now = std::chrono::steady_clock::now();
+    auto elapsed = now - mark;
+    mark = now;
+    return elapsed;
+  };
+
+  std::pmr::string transformed_line =
+      transform_command(input_line, &line_arena);
+  timing.transform = lap();
+  if (!batch && transformed_line != input_line) {
+    std::cout << "[Transformed] " << input_line << " → " << transformed_line
+              << std::endl;
+  }
+
+  try {
+    command_line.parse(transformed_line);
+  } catch (const std::exception &e) {
+    std::cerr << "Error: " << e.what() << std::endl;
+    last_status = 2;
+    return true;
+  }
+  std::vector<CommandLine::Stage> &stages = command_line.stages;
+
+  // `time` is a keyword, as in other shells: it times the whole line.
+  bool timed = time_every_line;
+  if (!stages.empty() && stages[0].args[0] == "time") {
+    timed = true;
+    stages[0].args.erase(stages[0].args.begin());
+    stages[0].argv.erase(stages[0].argv.begin());
+    if (stages[0].args.empty()) {
+      stages.erase(stages.begin());
+    }
+  }
+  timing.parse = lap();
+
+  if (stages.empty()) {
+    return true;
+  }
+
+  if (stages.size() == 1 && !command_line.background) {
+    std::string command(stages[0].args[0]);
+
+    if (runs_in_shell(stages[0])) {
+      struct rusage before, after;
+      getrusage(RUSAGE_THREAD, &before);
+      last_status = run_builtin_redirected(stages[0]);
+      getrusage(RUSAGE_THREAD, &after);
+      if (timed) {
+        timing.builtin = true;
+        timing.spawn = lap();
+        timing.real = timing.spawn;
+        timing.waited = true;
+        timersub(&after.ru_utime, &before.ru_utime, &timing.usage.ru_utime);
+        timersub(&after.ru_stime, &before.ru_stime, &timing.usage.ru_stime);
+        timing.usage.ru_maxrss = after.ru_maxrss;
+        timing.usage.ru_nvcsw = after.ru_nvcsw - before.ru_nvcsw;
+        timing.usage.ru_nivcsw = after.ru_nivcsw - before.ru_nivcsw;
+        report_timing(timing);
+      }
+      return true;
+    }
+
+    // `exit [n]` leaves with status n, or that of the last line.
+    if (command == "exit") {
+      if (stages[0].args.size() > 1) {
+        last_status = std::atoi(stages[0].argv[1]) & 0xff;
+      }
+      return false;
+    }
+  }
+
+  path_cache.refresh();
+  last_status = run_pipeline(stages, transformed_line,
+                             command_line.background,
+                             timed ? &timing : nullptr);
+  if (timed) {
+    report_timing(timing);
+  }
+  return true;
+}
+
+void Shell::handle_line(char *input) {
+  Shell &shell = *active;
+  if (!input) {
+    std::cout << std::endl;
+    shell.running = false;
+  } else {
+    if (*input) {
+      shell.running = shell.execute(input);
+    }
+    free(input);
+  }
+
+  if (!shell.running) {
+    rl_callback_handler_remove();
+    return;
+  }
+  shell.reap_jobs();
+  shell.jobs.report(std::cout, true);
+  global_stats.maybe_dump();
+  rl_set_prompt(shell.prompt().c_str());
+}
+
+int Shell::run() {
+  active = this;
+  running = true;
+  rl_callback_handler_install(prompt().c_str(), handle_line);
+  prefetcher = std::make_unique<Prefetcher>(
+      [this](char direction, const std::string &pattern,
+             const std::string &dir) {
+        return speculate(direction, pattern, dir);
+      });
+
+  // How long typing has to pause before the token under the cursor is
+  // taken to be complete enough to prefetch.
+  constexpr int pause_ms = 150;
+  bool token_waiting = false;
+  struct pollfd fds[3] = {{STDIN_FILENO, POLLIN, 0},
+                          {sigchld_fd, POLLIN, 0},
+                          {interrupt_fd, POLLIN, 0}};
+  while (running) {
+    int ready = poll(fds, 3, token_waiting ? pause_ms : -1);
+    if (ready < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      perror("poll failed");
+      break;
+    }
+    if (ready == 0) {
+      token_waiting = prefetch_tokens(true);
+      continue;
+    }
+    if (fds[1].revents & POLLIN) {
+      reap_jobs();
+    }
+    if ((fds[2].revents & POLLIN) && take_interrupt()) {
+      // ^C at the prompt discards the line being typed.
+      rl_callback_sigcleanup();
+      rl_free_line_state();
+      rl_crlf();
+      rl_replace_line("", 0);
+      rl_on_new_line();
+      rl_redisplay();
+      token_waiting = false;
+    }
+    if (jobs.has_changes()) {
+      rl_clear_visible_line();
+      jobs.report(std::cout, true);
+      rl_on_new_line();
+      rl_redisplay();
+    }
+    if (fds[0].revents & (POLLIN | POLLHUP | POLLERR)) {
+      rl_callback_read_char();
+      token_waiting = running && prefetch_tokens(false);
+    }
+  }
+  if (running) {
+    rl_callback_handler_remove();
+  }
+  prefetcher.reset();
+
+  std::cout << "Exiting tbsh." << std::endl;
+  return last_status;
+}
+
+bool Shell::execute_script_line(std::string_view line) {
+  if (line.empty() || line[0] == '#') {
+    return true;
+  }
+  bool keep_going = execute(line);
+  reap_jobs();
+  jobs.report(std::cerr, true);
+  global_stats.maybe_dump();
+  return keep_going;
+}
+
+int Shell::run_batch(int fd) {
+  LineReader reader(fd);
+  std::string_view line;
+  while (reader.next(line) && execute_script_line(line)) {
+  }
+  return last_status;
+}
+
+int Shell::run_batch(std::string_view script) {
+  while (!script.empty()) {
+    size_t newline = script.find('\n');
+    std::string_view line = script.substr(0, newline);
+    script.remove_prefix(newline == script.npos ? script.size()
+                                                : newline + 1);
+    if (!execute_script_line(line)) {
+      break;
+    }
+  }
+  return last_status;
+}
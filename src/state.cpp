@@ -0,0 +1,369 @@
+#include "tbsh.h"
+
+fs::path unique_temp_beside(const fs::path &path) {
+  std::string name = path.string() + ".XXXXXX";
+  int fd = mkstemp(name.data());
+  if (fd < 0) {
+    return {};
+  }
+  close(fd);
+  return name;
+}
+
+bool
+DirectoryHistory::RankOrder::operator()(const Rank &a, const Rank &b) const {
+  return a.first != b.first ? a.first > b.first : *a.second < *b.second;
+}
+
+const std::string *DirectoryHistory::intern(const std::string &path) {
+  auto it = pool.try_emplace(path, 0).first;
+  it->second++;
+  return &it->first;
+}
+
+void DirectoryHistory::release(const std::string *path) {
+  auto it = pool.find(*path);
+  if (--it->second == 0) {
+    pool.erase(it);
+  }
+}
+
+void DirectoryHistory::rank(const std::string *path, double score) {
+  ranking.insert({score, path});
+  for_each_component(*path, [&](std::string_view component) {
+    auto it = by_component.find(component);
+    if (it == by_component.end()) {
+      it = by_component.emplace(std::string(component), Ranking()).first;
+    }
+    it->second.insert({score, path});
+  });
+}
+
+void DirectoryHistory::unrank(const std::string *path, double score) {
+  ranking.erase({score, path});
+  for_each_component(*path, [&](std::string_view component) {
+    auto it = by_component.find(component);
+    it->second.erase({score, path});
+    if (it->second.empty()) {
+      by_component.erase(it);
+    }
+  });
+}
+
+void DirectoryHistory::credit(const std::string &path, double weight) {
+  auto interned = pool.find(path);
+  auto found = interned == pool.end() ? scores.end()
+                                      : scores.find(&interned->first);
+  if (found == scores.end()) {
+    const std::string *key = intern(path);
+    scores.emplace(key, weight);
+    rank(key, weight);
+    if (scores.size() > max_tracked) {
+      const std::string *last = std::prev(ranking.end())->second;
+      unrank(last, scores[last]);
+      scores.erase(last);
+      release(last);
+    }
+    return;
+  }
+  unrank(found->first, found->second);
+  double high = std::max(found->second, weight);
+  double low = std::min(found->second, weight);
+  found->second = high + std::log2(1 + std::exp2(low - high));
+  rank(found->first, found->second);
+}
+
+double DirectoryHistory::now_weight() {
+  return std::chrono::duration<double>(
+             std::chrono::system_clock::now().time_since_epoch())
+             .count() /
+         half_life;
+}
+
+void DirectoryHistory::append(const std::string &path, double weight) {
+  if (log_path.empty()) {
+    return;
+  }
+  std::error_code ec;
+  fs::create_directories(log_path.parent_path(), ec);
+  // Opened per visit so that a log compacted by another shell is picked
+  // up; a single O_APPEND write keeps concurrent shells from interleaving.
+  int fd = ::open(log_path.c_str(), O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC,
+                  0600);
+  if (fd < 0) {
+    return;
+  }
+  char line[PATH_MAX + 32];
+  int n = snprintf(line, sizeof(line), "%.6f %s\n", weight, path.c_str());
+  if (n > 0 && static_cast<size_t>(n) < sizeof(line)) {
+    ssize_t written = write(fd, line, n);
+    (void)written;
+  }
+  close(fd);
+}
+
+void DirectoryHistory::load() {
+  if (loaded) {
+    return;
+  }
+  loaded = true;
+  std::ifstream in(log_path);
+  std::string line;
+  size_t lines = 0;
+  while (std::getline(in, line)) {
+    size_t space = line.find(' ');
+    if (space == std::string::npos || space + 1 >= line.size()) {
+      continue;
+    }
+    char *end;
+    double weight = std::strtod(line.c_str(), &end);
+    if (end != line.c_str() + space) {
+      continue;
+    }
+    credit(line.substr(space + 1), weight);
+    lines++;
+  }
+  if (lines > 1000 && lines > 4 * scores.size()) {
+    compact();
+  }
+}
+
+void DirectoryHistory::compact() {
+  fs::path tmp = unique_temp_beside(log_path);
+  if (tmp.empty()) {
+    return;
+  }
+  bool written;
+  {
+    std::ofstream out(tmp, std::ios::trunc);
+    out << std::fixed << std::setprecision(6);
+    for (const auto &[score, path] : ranking) {
+      out << score << ' ' << *path << '\n';
+    }
+    written = static_cast<bool>(out);
+  }
+  std::error_code ec;
+  if (written) {
+    fs::rename(tmp, log_path, ec);
+  }
+  if (!written || ec) {
+    fs::remove(tmp, ec);
+  }
+}
+
+void DirectoryHistory::open(fs::path path) {
+  log_path = std::move(path);
+  loaded = false;
+}
+
+void DirectoryHistory::visit(const std::string &path) {
+  double weight = now_weight();
+  if (loaded) {
+    credit(path, weight);
+  }
+  append(path, weight);
+}
+
+void DirectoryHistory::add(const std::string &path) {
+  visit(path);
+  if (length > 0 && *at(current_index) == path) {
+    return;
+  }
+  while (length > current_index + 1) {
+    release(at(--length));
+  }
+  if (length == capacity) {
+    release(ring[head]);
+    head = (head + 1) % capacity;
+    length--;
+    if (current_index > 0) {
+      current_index--;
+    }
+  }
+  ring[(head + length) % capacity] = intern(path);
+  current_index = length++;
+}
+
+std::optional<std::string_view> DirectoryHistory::back() {
+  if (current_index == 0) {
+    return std::nullopt;
+  }
+  return *at(--current_index);
+}
+
+std::optional<std::string_view> DirectoryHistory::forward() {
+  if (current_index + 1 >= length) {
+    return std::nullopt;
+  }
+  return *at(++current_index);
+}
+
+std::optional<std::string> DirectoryHistory::best(
+    const std::vector<std::string_view> &terms, const std::string &exclude) {
+  load();
+  if (terms.empty()) {
+    return std::nullopt;
+  }
+  std::string_view last = terms.back();
+  auto accept = [&](const std::string &path) {
+    size_t pos = 0;
+    for (size_t i = 0; i + 1 < terms.size(); i++) {
+      pos = path.find(terms[i], pos);
+      if (pos == std::string::npos) {
+        return false;
+      }
+      pos += terms[i].size();
+    }
+    std::error_code ec;
+    return path != exclude && fs::is_directory(path, ec);
+  };
+
+  auto exact = by_component.find(last);
+  if (exact != by_component.end()) {
+    for (const auto &[score, path] : exact->second) {
+      if (accept(*path)) {
+        return *path;
+      }
+    }
+  }
+  for (const auto &[score, path] : ranking) {
+    if (path->find(last) != std::string::npos && accept(*path)) {
+      return *path;
+    }
+  }
+  return std::nullopt;
+}
+
+std::vector<std::pair<std::string, double>> DirectoryHistory::top(size_t n) {
+  load();
+  std::vector<std::pair<std::string, double>> result;
+  double present = now_weight();
+  for (auto it = ranking.begin(); it != ranking.end() && n > 0; ++it, n--) {
+    result.emplace_back(*it->second, std::exp2(it->first - present));
+  }
+  return result;
+}
+
+std::vector<std::string_view>
+HistoryLog::tail(const char *data, size_t size, size_t cap) {
+  std::vector<std::string_view> lines;
+  std::unordered_set<std::string_view> seen;
+  size_t end = size;
+  while (end > 0 && lines.size() < cap) {
+    const char *nl = static_cast<const char *>(
+        end > 1 ? memrchr(data, '\n', end - 1) : nullptr);
+    size_t start = nl ? nl - data + 1 : 0;
+    size_t length = end - start - (data[end - 1] == '\n');
+    std::string_view line(data + start, length);
+    if (!line.empty() && seen.insert(line).second) {
+      lines.push_back(line);
+    }
+    end = start;
+  }
+  std::reverse(lines.begin(), lines.end());
+  return lines;
+}
+
+void HistoryLog::write_out(const std::vector<std::string> &lines) {
+  std::string buffer;
+  for (const std::string &line : lines) {
+    buffer += line;
+    buffer += '\n';
+  }
+  std::error_code ec;
+  fs::create_directories(file.parent_path(), ec);
+  int fd = ::open(file.c_str(), O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC,
+                  0600);
+  if (fd < 0) {
+    return;
+  }
+  for (size_t done = 0; done < buffer.size();) {
+    ssize_t n = write(fd, buffer.data() + done, buffer.size() - done);
+    if (n <= 0) {
+      break;
+    }
+    done += n;
+  }
+  close(fd);
+}
+
+void HistoryLog::compact() {
+  fs::path tmp;
+  bool replace = false;
+  with_tail([&](const std::vector<std::string_view> &lines, size_t size) {
+    size_t kept = 0;
+    for (std::string_view line : lines) {
+      kept += line.size() + 1;
+    }
+    if (size <= 4 * kept + 65536 ||
+        (tmp = unique_temp_beside(file)).empty()) {
+      return;
+    }
+    std::ofstream out(tmp, std::ios::binary | std::ios::trunc);
+    for (std::string_view line : lines) {
+      out.write(line.data(), line.size());
+      out.put('\n');
+    }
+    replace = static_cast<bool>(out);
+  });
+  std::error_code ec;
+  if (replace) {
+    fs::rename(tmp, file, ec);
+  }
+  if (!tmp.empty() && (!replace || ec)) {
+    fs::remove(tmp, ec);
+  }
+}
+
+void HistoryLog::run() {
+  compact();
+  std::unique_lock<std::mutex> lock(mutex);
+  while (true) {
+    wake.wait_for(lock, flush_interval, [&] {
+      return stopping || pending.size() >= batch_size;
+    });
+    std::vector<std::string> lines;
+    lines.swap(pending);
+    bool done = stopping;
+    lock.unlock();
+    if (!lines.empty()) {
+      write_out(lines);
+      compact();
+    }
+    if (done) {
+      return;
+    }
+    lock.lock();
+  }
+}
+
+HistoryLog::~HistoryLog() {
+  if (writer.joinable()) {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      stopping = true;
+    }
+    wake.notify_one();
+    writer.join();
+  }
+}
+
+void HistoryLog::load() {
+  stifle_history(static_cast<int>(std::min<size_t>(cap, INT_MAX)));
+  with_tail([](const std::vector<std::string_view> &lines, size_t) {
+    std::string line;
+    for (std::string_view view : lines) {
+      line.assign(view);
+      add_history(line.c_str());
+    }
+  });
+  writer = std::thread([this] { run(); });
+}
+
+void HistoryLog::append(std::string line) {
+  std::lock_guard<std::mutex> lock(mutex);
+  pending.push_back(std::move(line));
+  if (pending.size() >= batch_size) {
+    wake.notify_one();
+  }
+}
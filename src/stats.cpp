@@ -0,0 +1,175 @@
+#include "tbsh.h"
+
+Stats global_stats;
+
+size_t Stats::Histogram::index(uint64_t ns) {
+  if (ns < sub_buckets) {
+    return ns;
+  }
+  int shift = 63 - __builtin_clzll(ns) - sub_bits;
+  return (shift + 1) * sub_buckets + ((ns >> shift) - sub_buckets);
+}
+
+uint64_t Stats::Histogram::upper(size_t i) {
+  if (i < sub_buckets) {
+    return i;
+  }
+  int shift = i / sub_buckets - 1;
+  uint64_t mantissa = sub_buckets + i % sub_buckets;
+  return ((mantissa + 1) << shift) - 1;
+}
+
+void Stats::Histogram::record(uint64_t ns) {
+  buckets[index(ns)].fetch_add(1, std::memory_order_relaxed);
+  total.fetch_add(1, std::memory_order_relaxed);
+  uint64_t seen = largest.load(std::memory_order_relaxed);
+  while (ns > seen && !largest.compare_exchange_weak(
+                          seen, ns, std::memory_order_relaxed)) {
+  }
+}
+
+uint64_t Stats::Histogram::percentile(double fraction) const {
+  uint64_t target = std::max<uint64_t>(1, std::ceil(fraction * count()));
+  uint64_t seen = 0;
+  for (size_t i = 0; i < bucket_count; i++) {
+    seen += buckets[i].load(std::memory_order_relaxed);
+    if (seen >= target) {
+      return std::min(upper(i), max());
+    }
+  }
+  return max();
+}
+
+void Stats::Histogram::reset() {
+  for (auto &bucket : buckets) {
+    bucket.store(0, std::memory_order_relaxed);
+  }
+  total.store(0, std::memory_order_relaxed);
+  largest.store(0, std::memory_order_relaxed);
+}
+
+Stats::Timed::Timed(Stats &stats, Timer timer)
+    : stats(stats), timer(timer), active(stats.enabled()) {
+  if (active) {
+    start = std::chrono::steady_clock::now();
+  }
+}
+
+Stats::Timed::~Timed() {
+  if (active) {
+    auto elapsed = std::chrono::steady_clock::now() - start;
+    stats.histograms[size_t(timer)].record(
+        std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed)
+            .count());
+  }
+}
+
+std::string Stats::duration(uint64_t ns) {
+  char text[32];
+  if (ns < 1000) {
+    snprintf(text, sizeof(text), "%lluns", (unsigned long long)ns);
+  } else if (ns < 1000000) {
+    snprintf(text, sizeof(text), "%.1fus", ns / 1e3);
+  } else if (ns < 1000000000) {
+    snprintf(text, sizeof(text), "%.1fms", ns / 1e6);
+  } else {
+    snprintf(text, sizeof(text), "%.2fs", ns / 1e9);
+  }
+  return text;
+}
+
+Stats::Stats() {
+  const char *env = getenv("TBSH_STATS");
+  on = env && *env && std::strcmp(env, "0") != 0;
+}
+
+void Stats::count(Cache cache, bool hit) {
+  if (enabled()) {
+    (hit ? hits : misses)[size_t(cache)].fetch_add(
+        1, std::memory_order_relaxed);
+  }
+}
+
+void Stats::reset() {
+  for (size_t i = 0; i < size_t(Cache::count); i++) {
+    hits[i].store(0, std::memory_order_relaxed);
+    misses[i].store(0, std::memory_order_relaxed);
+  }
+  for (Histogram &histogram : histograms) {
+    histogram.reset();
+  }
+}
+
+void Stats::report(std::ostream &out) const {
+  char line[128];
+  out << (enabled() ? "" : "(recording is off; `stats on` starts it)\n");
+  snprintf(line, sizeof(line), "%-12s %10s %10s %9s\n", "cache", "hits",
+           "misses", "hit rate");
+  out << line;
+  for (size_t i = 0; i < size_t(Cache::count); i++) {
+    uint64_t hit = hits[i].load(std::memory_order_relaxed);
+    uint64_t miss = misses[i].load(std::memory_order_relaxed);
+    if (hit + miss == 0) {
+      snprintf(line, sizeof(line), "%-12s %10s %10s %9s\n", cache_names[i],
+               "-", "-", "-");
+    } else {
+      snprintf(line, sizeof(line), "%-12s %10llu %10llu %8.1f%%\n",
+               cache_names[i], (unsigned long long)hit,
+               (unsigned long long)miss, 100.0 * hit / (hit + miss));
+    }
+    out << line;
+  }
+  snprintf(line, sizeof(line), "\n%-12s %10s %9s %9s %9s %9s\n", "latency",
+           "count", "p50", "p90", "p99", "max");
+  out << line;
+  for (size_t i = 0; i < size_t(Timer::count); i++) {
+    const Histogram &h = histograms[i];
+    if (h.count() == 0) {
+      snprintf(line, sizeof(line), "%-12s %10d %9s %9s %9s %9s\n",
+               timer_names[i], 0, "-", "-", "-", "-");
+    } else {
+      snprintf(line, sizeof(line), "%-12s %10llu %9s %9s %9s %9s\n",
+               timer_names[i], (unsigned long long)h.count(),
+               duration(h.percentile(0.5)).c_str(),
+               duration(h.percentile(0.9)).c_str(),
+               duration(h.percentile(0.99)).c_str(),
+               duration(h.max()).c_str());
+    }
+    out << line;
+  }
+  out.flush();
+}
+
+void Stats::dump_to(std::string path, std::chrono::seconds interval) {
+  dump_path = std::move(path);
+  dump_interval = interval;
+  last_dump = std::chrono::steady_clock::now();
+}
+
+void Stats::maybe_dump(bool force) {
+  if (dump_path.empty()) {
+    return;
+  }
+  auto now = std::chrono::steady_clock::now();
+  if (!force && now - last_dump < dump_interval) {
+    return;
+  }
+  last_dump = now;
+  // Written aside and renamed, so a reader never sees half a report; each
+  // shell dumping to the same file writes its own temporary.
+  fs::path temp = unique_temp_beside(dump_path);
+  if (temp.empty()) {
+    std::cerr << "stats: " << dump_path << ": " << strerror(errno)
+              << std::endl;
+    return;
+  }
+  {
+    std::ofstream out(temp, std::ios::trunc);
+    report(out);
+  }
+  if (rename(temp.c_str(), dump_path.c_str()) != 0) {
+    std::cerr << "stats: " << dump_path << ": " << strerror(errno)
+              << std::endl;
+    unlink(temp.c_str());
+  }
+}
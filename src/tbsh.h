@@ -0,0 +1,1578 @@
+// The tbsh core, shared by the shell, tbshd and tbsh_bench. The classes are
+// declared here and defined in the src/*.cpp files built into libtbsh.a;
+// only templates and one-line accessors stay inline.
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <cerrno>
+#include <chrono>
+#include <climits>
+#include <cmath>
+#include <condition_variable>
+#include <csignal>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <dirent.h>
+#include <fcntl.h>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <linux/io_uring.h>
+#include <list>
+#include <map>
+#include <memory>
+#include <memory_resource>
+#include <mutex>
+#include <optional>
+#include <poll.h>
+#include <queue>
+#include <readline/history.h>
+#include <readline/readline.h>
+#include <set>
+#include <spawn.h>
+#include <string>
+#include <string_view>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/statfs.h>
+#include <sys/syscall.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <thread>
+#include <unistd.h>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+namespace fs = std::filesystem;
+
+extern char **environ;
+
+// A new, empty file beside `path` with a name no other process is using,
+// for writing a replacement that is then renamed over `path`. Returns an
+// empty path if none could be created.
+fs::path unique_temp_beside(const fs::path &path);
+
+// Where the shell has been. Navigation for bk/fw is a ring of the last
+// `capacity` directories; frecency for z is kept per directory and every
+// visit is appended to a log, so it carries over between sessions. Paths are
+// interned, and a directory visited a thousand times is stored once.
+class DirectoryHistory {
+public:
+  static constexpr size_t capacity = 256;
+  static constexpr size_t max_tracked = 2000;
+  // A visit counts half as much after a week.
+  static constexpr double half_life = 7 * 24 * 3600.0;
+
+private:
+  // Interned paths and their reference counts; node keys never move.
+  std::unordered_map<std::string, size_t> pool;
+
+  std::vector<const std::string *> ring =
+      std::vector<const std::string *>(capacity);
+  size_t head = 0;
+  size_t length = 0;
+  size_t current_index = 0;
+
+  // Frecency is log2 of the sum of 2^(t / half_life) over the times t of all
+  // visits. Every directory decays at the same rate, so the order only
+  // changes when one is visited and can be kept in ordered sets: overall and
+  // per path component, which is what z looks up.
+  using Rank = std::pair<double, const std::string *>;
+  struct RankOrder {
+    bool operator()(const Rank &a, const Rank &b) const;
+  };
+  using Ranking = std::set<Rank, RankOrder>;
+  std::unordered_map<const std::string *, double> scores;
+  Ranking ranking;
+  std::map<std::string, Ranking, std::less<>> by_component;
+
+  // The log holds one `weight path` line per visit, where a line adds
+  // 2^weight to the path's frecency. It is read on the first z, not at
+  // startup; until then visits are only appended.
+  fs::path log_path;
+  bool loaded = true;
+
+  const std::string *intern(const std::string &path);
+
+  void release(const std::string *path);
+
+  const std::string *at(size_t i) const { return ring[(head + i) % capacity]; }
+
+  template <typename F> static void for_each_component(std::string_view path,
+                                                       F f) {
+    size_t pos = 0;
+    while (pos < path.size()) {
+      size_t end = path.find('/', pos);
+      if (end == std::string_view::npos) {
+        end = path.size();
+      }
+      if (end > pos) {
+        f(path.substr(pos, end - pos));
+      }
+      pos = end + 1;
+    }
+  }
+
+  void rank(const std::string *path, double score);
+
+  void unrank(const std::string *path, double score);
+
+  void credit(const std::string &path, double weight);
+
+  static double now_weight();
+
+  void append(const std::string &path, double weight);
+
+  void load();
+
+  // Rewrites the log as one line per tracked directory carrying its whole
+  // frecency. Visits another shell appends while the rename happens are lost.
+  void compact();
+
+public:
+  DirectoryHistory() = default;
+  DirectoryHistory(const DirectoryHistory &) = delete;
+  DirectoryHistory &operator=(const DirectoryHistory &) = delete;
+
+  // Persists frecency to `path`. Without it the history lasts one session.
+  void open(fs::path path);
+
+  // Records a visit to `path` for frecency without touching the ring.
+  void visit(const std::string &path);
+
+  // Navigates to `path`. Like a browser, going somewhere new from the
+  // middle of the history discards the entries ahead of the current one.
+  void add(const std::string &path);
+
+  // Steps back, returning the directory now current, or nothing at the
+  // oldest entry.
+  std::optional<std::string_view> back();
+
+  // Steps forward, returning the directory now current, or nothing at the
+  // newest entry.
+  std::optional<std::string_view> forward();
+
+  const std::string &current() const { return *at(current_index); }
+
+  // The best-ranked existing directory other than `exclude` that has a path
+  // component equal to the last of `terms` and contains the others in order.
+  // Finding that component's ranking is O(log n) and its best entry is the
+  // answer unless it no longer exists; if no component matches exactly, any
+  // directory containing the last term will do, in rank order.
+  std::optional<std::string> best(const std::vector<std::string_view> &terms,
+                                  const std::string &exclude);
+
+  // The `n` best-ranked directories with their frecency expressed as the
+  // number of visits made right now it is worth.
+  std::vector<std::pair<std::string, double>> top(size_t n);
+};
+
+// Instrumentation for the `stats` builtin: hit and miss counts for each
+// cache and latency histograms for the hot paths. Recording is off until
+// `stats on` or $TBSH_STATS turns it on, and costs a relaxed load and a
+// branch until then. Every count is a relaxed atomic, since the prefetcher
+// and tbshd's clients record from their own threads.
+class Stats {
+public:
+  enum class Cache { Upfind, Path, Completion, Index, Prefetch, Daemon, count };
+  enum class Timer { Upfind, Downfind, Transform, Completion, Spawn, count };
+
+  // Nanosecond latencies, bucketed like HdrHistogram: each power of two is
+  // split into 16 linear sub-buckets, so any percentile reported is within
+  // 1/16 of the true value, from 1 ns to centuries.
+  class Histogram {
+  private:
+    static constexpr int sub_bits = 4;
+    static constexpr size_t sub_buckets = size_t(1) << sub_bits;
+    static constexpr size_t bucket_count = 61 * sub_buckets;
+
+    std::atomic<uint64_t> buckets[bucket_count] = {};
+    std::atomic<uint64_t> total{0};
+    std::atomic<uint64_t> largest{0};
+
+    static size_t index(uint64_t ns);
+
+    // The largest value bucket `i` holds.
+    static uint64_t upper(size_t i);
+
+  public:
+    void record(uint64_t ns);
+
+    uint64_t count() const { return total.load(std::memory_order_relaxed); }
+    uint64_t max() const { return largest.load(std::memory_order_relaxed); }
+
+    // The latency `fraction` of the recordings are at or below.
+    uint64_t percentile(double fraction) const;
+
+    void reset();
+  };
+
+  // Records the time from its construction to its destruction, if recording
+  // was on when it started.
+  class Timed {
+  private:
+    Stats &stats;
+    Timer timer;
+    std::chrono::steady_clock::time_point start;
+    bool active;
+
+  public:
+    Timed(Stats &stats, Timer timer);
+    Timed(const Timed &) = delete;
+    Timed &operator=(const Timed &) = delete;
+    ~Timed();
+  };
+
+private:
+  static constexpr const char *cache_names[] = {
+      "upfind", "path", "completion", "index", "prefetch", "tbshd"};
+  static constexpr const char *timer_names[] = {
+      "upfind", "downfind", "transform", "completion", "spawn"};
+
+  std::atomic<bool> on{false};
+  std::atomic<uint64_t> hits[size_t(Cache::count)] = {};
+  std::atomic<uint64_t> misses[size_t(Cache::count)] = {};
+  Histogram histograms[size_t(Timer::count)];
+
+  std::string dump_path;
+  std::chrono::seconds dump_interval{0};
+  std::chrono::steady_clock::time_point last_dump;
+
+  static std::string duration(uint64_t ns);
+
+public:
+  Stats();
+
+  bool enabled() const { return on.load(std::memory_order_relaxed); }
+  void enable(bool enabled) { on = enabled; }
+
+  void count(Cache cache, bool hit);
+
+  void reset();
+
+  void report(std::ostream &out) const;
+
+  // Has the report written to `path` every `interval`, checked after each
+  // line and once more on exit; an empty path stops it.
+  void dump_to(std::string path, std::chrono::seconds interval);
+
+  void maybe_dump(bool force = false);
+};
+
+extern Stats global_stats;
+
+// Runs many statx calls at once: as one io_uring submission when the kernel
+// allows it, otherwise spread over a few threads. On NFS or FUSE each probe
+// is a round trip to a server; issued together they cost about one.
+class StatxBatch {
+public:
+  struct Probe {
+    std::string path;
+    struct statx st;
+    int error; // 0, or the errno the probe failed with
+  };
+
+private:
+  static constexpr unsigned ring_entries = 64;
+  static constexpr unsigned mask = STATX_TYPE | STATX_MTIME;
+  static constexpr size_t pool_size = 8;
+
+  // The ring, set up on first use; ring_usable turns false if that or any
+  // later submission fails.
+  int ring_fd = -1;
+  bool ring_usable = true;
+  void *sq_map = nullptr, *cq_map = nullptr;
+  size_t sq_map_size = 0, cq_map_size = 0;
+  io_uring_sqe *sqes = nullptr;
+  unsigned sq_size = 0;
+  unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+  unsigned *cq_head, *cq_tail, *cq_mask;
+  io_uring_cqe *cqes;
+
+  // The fallback: threads that drain `work` with the caller.
+  std::vector<std::thread> threads;
+  std::mutex mutex;
+  std::condition_variable wake, done;
+  std::vector<Probe> *work = nullptr;
+  std::atomic<size_t> next{0};
+  size_t busy = 0;
+  uint64_t generation = 0;
+  bool stopping = false;
+
+  static void probe(Probe &p);
+
+  bool setup_ring();
+
+  void unmap_ring();
+
+  // Submits probes[first, last) and waits for all of them. If the ring
+  // fails, whatever the kernel has not taken is probed here instead and the
+  // ring is retired in favour of the threads.
+  void run_on_ring(std::vector<Probe> &probes, size_t first, size_t last);
+
+  void drain();
+
+  void serve();
+
+  void run_on_threads(std::vector<Probe> &probes, size_t first);
+
+public:
+  StatxBatch() = default;
+  StatxBatch(const StatxBatch &) = delete;
+  StatxBatch &operator=(const StatxBatch &) = delete;
+
+  ~StatxBatch();
+
+  // Fills in every probe, through io_uring if `use_ring` and the kernel
+  // allows it, otherwise through the thread pool.
+  void run(std::vector<Probe> &probes, bool use_ring = true);
+};
+
+// Memoizes, per (directory, name), whether `directory/name` is a directory.
+// Each answer carries the mtime the directory had when it was probed, which
+// changes whenever an entry is added to or removed from it. Answers already
+// revalidated in the current epoch (one command line) are trusted outright.
+class UpfindCache {
+private:
+  struct Entry {
+    struct timespec mtime;
+    bool present;
+    uint64_t epoch;
+  };
+
+  std::unordered_map<std::string, Entry> entries;
+  std::unordered_map<std::string, bool> remote;
+  uint64_t epoch = 1;
+  static constexpr size_t max_entries = 4096;
+
+  static std::string key(std::string_view dir, const std::string &name);
+
+  static std::string join(std::string_view dir, const std::string &name);
+
+  static bool is_root(std::string_view dir) { return dir == "/"; }
+
+  static std::string_view parent(std::string_view dir);
+
+  // Returns whether `dir/name` is a directory, probing only when the cached
+  // answer is missing or `dir` has changed since.
+  bool has_directory(std::string_view dir, const std::string &name);
+
+  // has_directory for `dir` and each of its ancestors up to the nearest one
+  // already known to hold `name`, with all the probes issued at once: every
+  // directory, for its mtime, and the candidate below each directory not
+  // cached yet. Every answer is kept, even those above the nearest hit.
+  std::optional<std::string> probe_together(std::string_view dir,
+                                            const std::string &name,
+                                            StatxBatch &batch, bool use_ring);
+
+public:
+  // Starts a new epoch, making every entry subject to revalidation again.
+  // Past max_entries, the entries not used in the last epoch are dropped,
+  // so that a long-lived cache (tbshd's) does not grow without bound.
+  void next_epoch();
+
+  // Returns the nearest of `start` (an absolute path) and its ancestors that
+  // holds a directory `name`. The levels not answered in this epoch are
+  // probed one at a time, nearest first, or, given `batch`, all at once.
+  std::optional<std::string> nearest(const std::string &start,
+                                     const std::string &name,
+                                     StatxBatch *batch = nullptr,
+                                     bool use_ring = true);
+
+  // Whether `dir` is on a network or FUSE filesystem, where every probe is a
+  // round trip and batching them pays off.
+  bool on_remote_filesystem(const std::string &dir);
+
+  // Drops every entry whose directory is not `cwd` or one of its ancestors.
+  void retain_chain(const std::string &cwd);
+
+  void clear();
+};
+
+// Decides which directories a search may skip: those named on a skip list
+// ($TBSH_SKIP, colon-separated, ".git:.hg:.svn:node_modules:build" by
+// default) and those matched by .gitignore and .ignore files, from the
+// enclosing repository's root down. Rules only ever prune directories; a
+// file matched by `*.log` is still found. Each rule file is parsed once into
+// compiled rules and reused until its mtime or size changes.
+class IgnoreRules {
+private:
+  struct Rule {
+    enum class Kind { Literal, Suffix, Glob } kind;
+    std::string text;
+    bool negated = false;
+    // Matched against the path below the rule file's directory rather than
+    // the directory name alone.
+    bool anchored = false;
+  };
+  using RuleList = std::vector<Rule>;
+
+  struct Cached {
+    struct timespec mtime;
+    off_t size;
+    std::shared_ptr<const RuleList> rules;
+  };
+
+  std::unordered_set<std::string> skip_names;
+  std::mutex mutex;
+  std::unordered_map<std::string, Cached> cache;
+
+public:
+  // The rules in effect in one directory: those of its own files on top of
+  // its parent's.
+  struct Layer {
+    std::shared_ptr<const Layer> parent;
+    std::string dir;
+    std::shared_ptr<const RuleList> gitignore, ignore;
+  };
+  using LayerPtr = std::shared_ptr<const Layer>;
+
+private:
+  static bool has_glob(std::string_view s);
+
+  // fnmatch with FNM_PATHNAME semantics, plus `**`, which also crosses `/`.
+  static bool glob_match(std::string_view p, std::string_view s);
+
+  static std::optional<Rule> compile(std::string_view line);
+
+  static bool matches(const Rule &rule, std::string_view name,
+                      std::string_view rel);
+
+  // The compiled rules of the file at `path`, or nullptr if there is none.
+  std::shared_ptr<const RuleList> read(const std::string &path);
+
+  // Whether `name` appears as a directory component of `pattern`, which
+  // asks for that directory explicitly.
+  static bool named_in(std::string_view pattern, std::string_view name);
+
+public:
+  IgnoreRules();
+
+  IgnoreRules(const IgnoreRules &) = delete;
+  IgnoreRules &operator=(const IgnoreRules &) = delete;
+
+  // The rules in effect when entering `dir` (absolute), given its parent's
+  // layer and whether its listing had a .gitignore or an .ignore.
+  LayerPtr enter(const LayerPtr &parent, const std::string &dir,
+                 bool has_gitignore, bool has_ignore);
+
+  // The rules in effect above a search starting at `start`: those of every
+  // directory from the enclosing repository root down to its parent.
+  LayerPtr above(const fs::path &start);
+
+  // Whether a search for `patterns` can skip the directory `name`, at
+  // absolute `path`, inside a directory governed by `layer`. Directories a
+  // pattern names are never skipped.
+  bool skip(const Layer *layer, std::string_view name, std::string_view path,
+            const std::vector<std::string> &patterns) const;
+
+  // Whether a walk from the repository root would prune the directory at
+  // absolute `path`, whatever is searched for.
+  bool prunes(const fs::path &path);
+
+  // Walks `root`/`rel_dir` for an index, calling on_dir(rel) for every
+  // directory entered, the first included, and on_file(rel) for every entry
+  // that is not a directory, `rel` being relative to `root`. Symlinked
+  // directories are neither; `.git` and the directories the rules prune are
+  // not entered. Stops when on_dir returns false, and returns whether the
+  // walk got to the end.
+  template <typename OnDir, typename OnFile>
+  bool walk(const fs::path &root, const std::string &rel_dir, OnDir on_dir,
+            OnFile on_file) {
+    static const std::vector<std::string> no_patterns;
+    std::string root_dir = root.string();
+    auto absolute = [&](const std::string &rel) {
+      return rel.empty() ? root_dir : root_dir + "/" + rel;
+    };
+    struct Pending {
+      std::string rel;
+      LayerPtr layer;
+    };
+    std::vector<Pending> stack{{rel_dir, above(absolute(rel_dir))}};
+    while (!stack.empty()) {
+      Pending dir = std::move(stack.back());
+      stack.pop_back();
+      if (!on_dir(dir.rel)) {
+        return false;
+      }
+      std::string path = absolute(dir.rel);
+      std::vector<std::pair<std::string, bool>> entries; // name, directory
+      bool has_gitignore = false, has_ignore = false;
+      std::error_code ec;
+      for (fs::directory_iterator
+               it(path, fs::directory_options::skip_permission_denied, ec),
+           end;
+           !ec && it != end; it.increment(ec)) {
+        std::string name = it->path().filename().string();
+        bool is_dir = it->is_directory(ec);
+        if (is_dir && it->is_symlink(ec)) {
+          continue;
+        }
+        has_gitignore |= name == ".gitignore";
+        has_ignore |= name == ".ignore";
+        entries.emplace_back(std::move(name), is_dir);
+      }
+      LayerPtr layer = enter(dir.layer, path, has_gitignore, has_ignore);
+      for (auto &[name, is_dir] : entries) {
+        std::string rel = dir.rel.empty() ? name : dir.rel + "/" + name;
+        if (!is_dir) {
+          on_file(std::move(rel));
+        } else if (name != ".git" &&
+                   !skip(layer.get(), name, absolute(rel), no_patterns)) {
+          stack.push_back({std::move(rel), layer});
+        }
+      }
+    }
+    return true;
+  }
+};
+
+// Sorted, suffix-searchable list of the files below a project root. Paths are
+// stored relative to the root and reversed, so that a suffix query becomes a
+// prefix range in the sorted order. The on-disk layout is
+//   "TBSHIDX2" | u64 count | u64 offsets[count] | NUL-terminated paths
+// and is memory-mapped read-only; changes since the last save live in a small
+// in-memory overlay that is merged back on save().
+class FileIndex {
+private:
+  static constexpr char magic[8] = {'T', 'B', 'S', 'H', 'I', 'D', 'X', '2'};
+
+  fs::path root_path;
+  fs::path index_file;
+
+  void *map = nullptr;
+  size_t map_size = 0;
+  const uint64_t *offsets = nullptr;
+  const char *blob = nullptr;
+  size_t count = 0;
+
+  std::set<std::string> added;
+  std::unordered_set<std::string> removed;
+  bool dirty = false;
+  mutable std::mutex mutex;
+  // char_mask() of every base entry, computed on the first fuzzy query.
+  mutable std::vector<uint64_t> base_masks;
+
+  static std::string reversed(std::string_view s);
+
+  static uint64_t fnv1a(const std::string &s);
+
+  std::string_view base_entry(size_t i) const;
+
+  static char fold(char c);
+
+  // One bit per letter, digit and common path punctuation that occurs in
+  // `s`, ignoring case.
+  static uint64_t char_mask(std::string_view s);
+
+  // Scores `query` (already case-folded) as a subsequence of a path given in
+  // its reversed, stored form. The tightest window ending at the first full
+  // match is scored: every matched character counts, consecutive matches and
+  // matches at the start of a path component or word count extra, gaps cost,
+  // and a match that lies entirely within the file name gets a bonus.
+  static std::optional<int> fuzzy_score(std::string_view rev,
+                                        std::string_view query);
+
+  void unmap();
+
+  bool load();
+
+  // The saved entries with the overlay applied, in order. The views point
+  // into the mapping and the overlay.
+  std::vector<std::string_view> merged_locked() const;
+
+  void save_locked();
+
+public:
+  explicit FileIndex(const fs::path &root);
+
+  ~FileIndex();
+
+  FileIndex(const FileIndex &) = delete;
+  FileIndex &operator=(const FileIndex &) = delete;
+
+  const fs::path &root() const { return root_path; }
+
+  // Maps the saved index, building it from a full walk if there is none.
+  void open(IgnoreRules &ignore);
+
+  // Replaces the index with a fresh walk of the whole tree. Neither `.git`
+  // nor the directories `ignore` prunes are indexed.
+  void rebuild(IgnoreRules &ignore);
+
+  // Replaces the whole index with `files` (paths relative to the root) and
+  // saves it, unless that is what it already holds.
+  void assign(const std::vector<std::string> &files);
+
+  // Records a file (relative to the root) that appeared since the last save.
+  void add(const std::string &rel_path);
+
+  // Records a file (relative to the root) that disappeared since the last
+  // save.
+  void remove(const std::string &rel_path);
+
+  // Records the removal of every file below the directory `rel_dir`.
+  void remove_tree(const std::string &rel_dir);
+
+  // Finds the shallowest indexed file below `scope` (a directory relative to
+  // the root, empty for the root itself) whose path relative to `scope` ends
+  // with `pattern`. Returns the path relative to the root.
+  std::optional<std::string> find_suffix(const std::string &pattern,
+                                         const std::string &scope) const;
+
+  // One fuzzy candidate: a path relative to the root and its score.
+  struct FuzzyMatch {
+    std::string path;
+    int score;
+  };
+
+  // Ranks the files below `scope` whose path relative to `scope` contains
+  // the characters of `query` in order (ignoring case), fzf-style, and
+  // returns the best `limit` of them, best first.
+  std::vector<FuzzyMatch> fuzzy_find(const std::string &query,
+                                     const std::string &scope,
+                                     size_t limit) const;
+
+  // Writes the merged index to disk atomically and re-maps it.
+  void save();
+};
+
+// Keeps a FileIndex live by applying inotify events for every directory below
+// its root. The initial watch setup doubles as a full rescan, so once ready()
+// the index can be trusted without touching the filesystem.
+class IndexWatcher {
+private:
+  FileIndex &index;
+  IgnoreRules &ignore;
+  int inotify_fd = -1;
+  int wake_fd = -1;
+  std::unordered_map<int, std::string> watched_dirs;
+  std::atomic<bool> is_ready{false};
+  // Set by the destructor, so that a scan in progress gives up early.
+  std::atomic<bool> stopping{false};
+  std::thread thread;
+
+  static constexpr uint32_t watch_mask = IN_CREATE | IN_DELETE | IN_MOVED_FROM |
+                                         IN_MOVED_TO | IN_ONLYDIR |
+                                         IN_DONT_FOLLOW | IN_EXCL_UNLINK;
+
+  static std::string join(const std::string &dir, const char *name);
+
+  // Watches `rel_dir` and everything below it that `ignore` does not prune,
+  // collecting the files found. Returns false when out of watches.
+  bool watch_tree(const std::string &rel_dir,
+                  std::vector<std::string> &files);
+
+  void unwatch_tree(const std::string &rel_dir);
+
+  // Stops watching for good: every watch is released, since inotify's
+  // per-user limit is shared with every other program, and lookups go back
+  // to checking what the index says.
+  void give_up();
+
+  // Applies one event. Returns false when out of watches.
+  bool handle(const struct inotify_event &event);
+
+  void loop();
+
+public:
+  IndexWatcher(FileIndex &index, IgnoreRules &ignore);
+
+  ~IndexWatcher();
+
+  IndexWatcher(const IndexWatcher &) = delete;
+  IndexWatcher &operator=(const IndexWatcher &) = delete;
+
+  // True once the initial scan has been applied and events are flowing.
+  bool ready() const { return is_ready; }
+};
+
+// Raw directory entry as returned by getdents64(2).
+struct linux_dirent64 {
+  ino64_t d_ino;
+  off64_t d_off;
+  unsigned short d_reclen;
+  unsigned char d_type;
+  char d_name[];
+};
+
+// Searches a tree for the shallowest file whose path relative to the start
+// ends with each of a set of patterns, one level at a time: the directories
+// at one depth are shared out among the threads, and the next depth is only
+// started once all of them have been read. A pattern matched on a level
+// keeps the match that sorts first, since nothing deeper can improve on it.
+// The entry limit is charged a whole level at a time, so that no match is
+// missed for one found deeper. Directories `ignore` prunes are skipped, and
+// the threads are kept from one search to the next.
+class ParallelWalker {
+private:
+  struct Dir {
+    std::string rel;
+    IgnoreRules::LayerPtr layer;
+  };
+
+  // What one thread found on the current level.
+  struct Shard {
+    std::vector<Dir> next;
+    std::vector<std::optional<std::string>> best;
+    size_t entries = 0;
+  };
+
+  // The search in progress, which the threads only read while a level is
+  // being walked.
+  const std::vector<std::string> *patterns = nullptr;
+  const std::vector<std::optional<std::string>> *found = nullptr;
+  IgnoreRules *ignore = nullptr;
+  std::string start_dir;
+  int root_fd = -1;
+  std::vector<Dir> level;
+  std::atomic<size_t> next_dir{0};
+  std::vector<Shard> shards; // one per thread, the caller's first
+  bool limit_hit = false;
+
+  // Threads that walk each level with the caller.
+  std::vector<std::thread> threads;
+  std::mutex mutex;
+  std::condition_variable wake, done;
+  size_t busy = 0;
+  uint64_t generation = 0;
+  bool stopping = false;
+  // Held for a whole search, which has a single copy of this state.
+  std::mutex search_mutex;
+
+  static bool matches(const std::string &rel, const std::string &pattern);
+
+  void scan(Shard &shard, const Dir &dir);
+
+  std::string join(const std::string &rel) const;
+
+  void drain(Shard &shard);
+
+  // Walks each level after `seen`, the last one started before this thread.
+  void serve(size_t self, uint64_t seen);
+
+  void stop_threads();
+
+  // Walks every directory of `level` and returns once all have been read.
+  void walk_level();
+
+public:
+  ParallelWalker() = default;
+  ParallelWalker(const ParallelWalker &) = delete;
+  ParallelWalker &operator=(const ParallelWalker &) = delete;
+
+  ~ParallelWalker() { stop_threads(); }
+
+  // Returns the match for each pattern as an absolute path, if it has one,
+  // looking no further once `limit` entries have been seen. Throws if
+  // `start` cannot be opened.
+  std::vector<std::optional<std::string>>
+  search(const std::vector<std::string> &patterns, const fs::path &start,
+         size_t limit, size_t threads, IgnoreRules *ignore = nullptr);
+
+  // Whether the last search gave up after `limit` entries.
+  bool limit_reached() const { return limit_hit; }
+};
+
+// Remembers where each command was found on $PATH, like bash's `hash`. The
+// table is dropped whenever $PATH changes or one of its directories gets a
+// new mtime, i.e. has had executables added, removed or renamed.
+class PathCache {
+private:
+  struct Dir {
+    std::string path;
+    struct timespec mtime;
+  };
+
+  struct Entry {
+    std::string path;
+    size_t hits;
+  };
+
+  std::optional<std::string> path_env;
+  std::vector<Dir> dirs;
+  std::unordered_map<std::string, Entry> commands;
+
+  static struct timespec mtime_of(const std::string &dir);
+
+  static bool is_executable(const std::string &path);
+
+public:
+  // Revalidates the table against the current $PATH and directory mtimes.
+  void refresh();
+
+  // Returns the path to execute for `name`. Names containing a slash are
+  // used as they are; hits in relative $PATH entries are not remembered.
+  std::optional<std::string> lookup(const std::string &name);
+
+  void forget(const std::string &name) { commands.erase(name); }
+
+  std::vector<std::string> directories();
+
+  void clear() { commands.clear(); }
+
+  // Prints the table as `hits<TAB>path`, sorted by command name.
+  void print(std::ostream &out) const;
+};
+
+// Sorted directory listings for tab completion, keyed by directory and
+// revalidated by its mtime, so repeated Tab presses in a large directory do
+// not re-read it. Names are sorted case-insensitively, matching readline's
+// completion-ignore-case, so a prefix selects a contiguous range; while the
+// prefix only grows, each lookup narrows the previous range instead of
+// searching the whole listing again.
+class CompletionCache {
+public:
+  struct Entry {
+    std::string name;
+    bool is_directory;
+    bool is_executable_candidate; // regular file or symlink
+  };
+
+private:
+  struct Listing {
+    struct timespec mtime;
+    std::vector<Entry> entries;
+  };
+
+  struct Narrowed {
+    std::string dir;
+    std::string prefix;
+    size_t lo = 0, hi = 0;
+  };
+
+  static constexpr size_t max_listings = 64;
+
+  std::unordered_map<std::string, Listing> listings;
+  Narrowed last;
+
+  static int compare_folded(std::string_view a, std::string_view b,
+                            size_t n = std::string_view::npos);
+
+  static void read_listing(const std::string &dir, Listing &listing);
+
+public:
+  // Returns the listing of `dir` (an absolute path), re-reading it only when
+  // its mtime changed.
+  const std::vector<Entry> &entries(const std::string &dir);
+
+  // Returns the entries of `dir` whose names start with `prefix`, ignoring
+  // case. Hidden entries only match a prefix that starts with a dot.
+  std::vector<const Entry *> matches(const std::string &dir,
+                                     const std::string &prefix);
+};
+
+// Finds `<path` and `>path` tokens in a command line, i.e. the matches of
+// `(<|>)([a-zA-Z0-9_.\-/]+)`, in a single left-to-right pass without
+// allocating.
+class SigilScanner {
+private:
+  std::string_view line;
+  size_t pos = 0;
+
+  static bool is_path_char(char c);
+
+public:
+  struct Token {
+    size_t pos;     // offset of the sigil
+    char direction; // '<' or '>'
+    std::string_view path;
+
+    size_t length() const { return path.size() + 1; }
+  };
+
+  explicit SigilScanner(std::string_view line) : line(line) {}
+
+  // Appends `path` to `out` so that CommandLine::parse reads it back as one
+  // literal word: as it is when it holds nothing special, single-quoted
+  // otherwise.
+  static void append_quoted(std::pmr::string &out, std::string_view path);
+
+  // Quoted text and escaped characters are left alone, as CommandLine::parse
+  // takes them literally.
+  std::optional<Token> next();
+};
+
+// Resolves sigil tokens on a background thread while the line is still
+// being typed, so that transform_command finds most answers waiting. Only
+// successful resolutions are kept, and only until the line is submitted.
+class Prefetcher {
+public:
+  // Resolves one token from a directory, or returns nothing.
+  using Resolver = std::function<std::optional<std::string>(
+      char direction, const std::string &pattern, const std::string &dir)>;
+
+private:
+  Resolver resolver;
+  std::mutex mutex;
+  std::condition_variable changed;
+  std::deque<std::string> queue;
+  std::string in_flight;
+  std::unordered_set<std::string> requested;
+  std::unordered_map<std::string, std::string> results;
+  bool stopping = false;
+  std::thread worker;
+
+  static std::string key(char direction, std::string_view pattern,
+                         const std::string &dir);
+
+  void run();
+
+public:
+  explicit Prefetcher(Resolver resolver);
+
+  Prefetcher(const Prefetcher &) = delete;
+  Prefetcher &operator=(const Prefetcher &) = delete;
+
+  ~Prefetcher();
+
+  // Queues `token` for resolution from `dir` unless it was already asked
+  // for since the last clear().
+  void request(const SigilScanner::Token &token, const std::string &dir);
+
+  // The prefetched resolution of a token, waiting for it if it is being
+  // resolved right now. A token still queued is dropped, since the caller
+  // is about to resolve it anyway.
+  std::optional<std::string> take(char direction, std::string_view pattern,
+                                  const std::string &dir);
+
+  // Forgets every request and result; called once a line is submitted.
+  void clear();
+};
+
+// Pipelines started by the shell, each running in its own process group.
+// Foreground jobs live here too while they run, so that the reaper and the
+// foreground wait apply wait statuses the same way.
+class JobTable {
+public:
+  enum class State { Running, Stopped, Done };
+
+  struct Job {
+    int id;
+    pid_t pgid;
+    std::string command;
+    std::vector<pid_t> pids;
+    size_t live;
+    State state = State::Running;
+    int status = 0; // wait status of the last stage
+    bool changed = false;
+    struct rusage usage {}; // summed over the stages that have finished
+  };
+
+private:
+  std::map<int, Job> jobs;
+
+  static const char *state_name(const Job &job);
+
+public:
+  Job &add(pid_t pgid, std::vector<pid_t> pids, std::string command);
+
+  // Resolves `%n`, `n` or an empty spec (the most recent job).
+  Job *find(std::string_view spec);
+
+  // Adds the resources used by one process to `total`: times and counts
+  // are summed, the peak RSS is the largest of any.
+  static void add_usage(struct rusage &total, const struct rusage &usage);
+
+  // Applies a status and resource usage returned by wait4 to the job owning
+  // `pid`.
+  void update(pid_t pid, int status, const struct rusage &usage);
+
+  void remove(int id) { jobs.erase(id); }
+
+  bool has_changes() const;
+
+  std::vector<int> ids() const;
+
+  // Prints every job (or only those whose state changed since they were last
+  // printed) and forgets the finished ones.
+  void report(std::ostream &out, bool changed_only);
+};
+
+// A command line split into words the way a POSIX shell does it: blanks
+// separate words, single quotes keep everything literally, double quotes
+// keep everything but backslash escapes of $ ` " \ and newline, and an
+// unquoted backslash escapes any character. The words are written
+// NUL-terminated into one arena sized for the whole line, so both `args` and
+// the execvp-ready `argv` of each stage point into it without further copies.
+// Reusing one CommandLine across lines reuses its buffers.
+//
+// An unquoted `|` separates pipeline stages and a trailing `&` runs the
+// pipeline in the background. `<`, `>` and `>>` redirect a stage only when
+// they stand alone as a word, so that `>name` and `<name` stay path-find
+// sigils even when transform_command could not resolve them.
+class CommandLine {
+public:
+  struct Stage {
+    std::vector<std::string_view> args;
+    std::vector<char *> argv; // args as C strings, nullptr-terminated
+    const char *input = nullptr;
+    const char *output = nullptr;
+    bool append = false;
+
+    bool redirected() const { return input || output; }
+  };
+
+private:
+  std::string arena;
+  // Stages of earlier lines, emptied but keeping their capacity, so that a
+  // line no longer than those before it parses without allocating.
+  std::vector<Stage> spare;
+
+  void recycle();
+
+  void add_stage();
+
+public:
+  std::vector<Stage> stages;
+  bool background = false;
+
+  void parse(std::string_view line);
+};
+
+// Splits the contents of a file descriptor into lines through one large
+// buffer. Each line is a view into that buffer, valid until the next call.
+class LineReader {
+private:
+  int fd;
+  std::vector<char> buffer;
+  size_t begin = 0;
+  size_t end = 0;
+  bool eof = false;
+
+public:
+  explicit LineReader(int fd, size_t capacity = 1 << 20)
+      : fd(fd), buffer(capacity) {}
+
+  bool next(std::string_view &line);
+};
+
+// Persists readline history. Loading maps the file and reads back only the
+// newest `cap` distinct lines, so startup does not depend on how long the
+// file has grown. New lines are handed to a writer thread that appends them
+// in batches, and rewrites the file without duplicates once it grows to
+// several times what is kept.
+class HistoryLog {
+private:
+  fs::path file;
+  size_t cap;
+
+  std::mutex mutex;
+  std::condition_variable wake;
+  std::vector<std::string> pending;
+  bool stopping = false;
+  std::thread writer;
+
+  static constexpr size_t batch_size = 32;
+  static constexpr auto flush_interval = std::chrono::seconds(2);
+
+  // The newest `cap` distinct lines of `data`, oldest first.
+  static std::vector<std::string_view> tail(const char *data, size_t size,
+                                            size_t cap);
+
+  // Calls `f` with the kept lines of the file, mapped for the duration.
+  template <typename F> bool with_tail(F f) {
+    int fd = ::open(file.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+      return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0) {
+      close(fd);
+      return false;
+    }
+    void *map = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+      return false;
+    }
+    f(tail(static_cast<const char *>(map), st.st_size, cap), st.st_size);
+    munmap(map, st.st_size);
+    return true;
+  }
+
+  void write_out(const std::vector<std::string> &lines);
+
+  // Rewrites the file as its kept lines once it is more than four times
+  // their size. Lines another shell appends during the rename are lost.
+  void compact();
+
+  void run();
+
+public:
+  HistoryLog(fs::path file, size_t cap) : file(std::move(file)), cap(cap) {}
+
+  HistoryLog(const HistoryLog &) = delete;
+  HistoryLog &operator=(const HistoryLog &) = delete;
+
+  ~HistoryLog();
+
+  // Fills readline's history from the file, caps it and starts the writer.
+  void load();
+
+  void append(std::string line);
+};
+
+// One `<` or `>` token of a line, and what it resolved to.
+struct Resolution {
+  char direction;
+  std::string pattern;
+  bool found = false;
+  std::string text; // the path, or why there is none
+};
+
+// Talks to a running tbshd over its Unix socket, one request at a time.
+// Every call returns nothing when there is no daemon or it misbehaves,
+// and the caller resolves in-process instead; after a failure the daemon
+// is left alone for a few seconds. Requests and replies are single lines of
+// tab-separated fields:
+//
+//   resolve <direction> <dir> <pattern>
+//       -> ok <path>  |  err <message>
+//   complete <dir> <text>
+//       -> ok <candidate>...
+//
+// The resolves of one line are sent together and answered in order.
+class DaemonClient {
+private:
+  std::string socket_path;
+  int fd = -1;
+  std::string buffer;
+  std::chrono::steady_clock::time_point retry_at{};
+  std::mutex mutex;
+
+  static constexpr auto retry_delay = std::chrono::seconds(5);
+  // Long enough for a cold daemon to index a large project.
+  static constexpr int reply_timeout_ms = 10000;
+
+  void disconnect();
+
+  bool connect_locked();
+
+  bool send_locked(const std::string &request);
+
+  // Reads the next reply and splits it into fields.
+  std::optional<std::vector<std::string>> reply_locked();
+
+  static bool sendable(const std::string &s);
+
+public:
+  explicit DaemonClient(std::string socket_path = default_path())
+      : socket_path(std::move(socket_path)) {}
+
+  DaemonClient(const DaemonClient &) = delete;
+  DaemonClient &operator=(const DaemonClient &) = delete;
+
+  ~DaemonClient();
+
+  // $XDG_RUNTIME_DIR/tbshd.sock, or /tmp/tbshd-<uid>.sock.
+  static std::string default_path();
+
+  // Resolves every token of `batch` from `dir` in one round trip. Returns
+  // false, leaving the batch to the caller, if the daemon cannot answer.
+  bool resolve(std::vector<Resolution> &batch, const std::string &dir);
+
+  std::optional<std::vector<std::string>> complete(const std::string &text,
+                                                   const std::string &dir);
+};
+
+// What `time` reports for one line. `transform`, `parse` and `spawn` are
+// the shell's own work (`spawn` is the builtin itself for an in-process
+// builtin); `real`, from the first spawn until the last exit, and `usage`
+// cover the foreground job, once `waited`.
+struct LineTiming {
+  std::chrono::steady_clock::duration transform{}, parse{}, spawn{}, real{};
+  struct rusage usage {};
+  bool builtin = false;
+  bool waited = false;
+};
+
+// How a launched process is plumbed in: its stdin and stdout (-1 to
+// inherit the shell's), the process group to join (0 to lead a new one),
+// whether that group takes over the terminal, and its stderr.
+struct ChildSetup {
+  int in_fd = -1;
+  int out_fd = -1;
+  pid_t pgid = 0;
+  bool foreground = false;
+  int err_fd = -1;
+};
+
+// An in-process stand-in for an external command that scripts run often.
+// `accepts` says whether it supports the arguments (the command name
+// first); when it does not, the external command runs as usual. `run`
+// writes straight to the standard file descriptors and returns the exit
+// status.
+struct FastCommand {
+  std::function<bool(const std::vector<std::string_view> &)> accepts;
+  std::function<int(const std::vector<std::string_view> &)> run;
+};
+
+class Shell {
+private:
+  std::unordered_map<std::string,
+                     std::function<void(std::vector<std::string_view> &)>>
+      custom_commands;
+  std::unordered_map<std::string, FastCommand> fast_commands;
+  CommandLine command_line;
+  // Scratch space for the line being run, released when the next starts.
+  alignas(std::max_align_t) std::byte line_buffer[16 * 1024];
+  std::pmr::monotonic_buffer_resource line_arena{line_buffer,
+                                                 sizeof(line_buffer)};
+  UpfindCache upfind_cache;
+  StatxBatch upfind_batch;
+  ParallelWalker walker;
+  CompletionCache completion_cache;
+  IgnoreRules ignore_rules;
+  // The indexes of recently used projects, most recent first, each with
+  // the watcher keeping it live (null if watching failed).
+  struct Project {
+    std::unique_ptr<FileIndex> index;
+    std::unique_ptr<IndexWatcher> watcher;
+  };
+  std::list<Project> projects;
+  std::unique_ptr<DaemonClient> daemon;
+  std::unique_ptr<HistoryLog> history;
+  // Guards what resolving a sigil touches (upfind_cache and projects),
+  // which the prefetcher, or tbshd's connections, do from other threads.
+  std::mutex resolve_mutex;
+  std::unique_ptr<Prefetcher> prefetcher;
+  // How many ranked candidates Tab offers after `>`.
+  static constexpr size_t fuzzy_candidates = 20;
+
+  bool batch;
+  // Only an interactive shell puts jobs in process groups of their own and
+  // hands them the terminal; otherwise children stay in the shell's group.
+  bool interactive = false;
+  // The exit status of the last foreground line, as `$?` would give it.
+  int last_status = 0;
+
+  // The working directory as last set by the shell, and the prompt built
+  // from it, so that neither needs a getcwd per line.
+  std::string cwd;
+  std::string prompt_text;
+  pid_t shell_pgid = 0;
+  int sigchld_fd = -1;
+  // SIGINT, which an interactive shell reads instead of dying of it, so
+  // that ^C clears the prompt and reaches the jobs par keeps.
+  int interrupt_fd = -1;
+  bool running = false;
+  static inline Shell *active = nullptr;
+  static inline std::vector<std::string> pending_matches;
+
+public:
+  DirectoryHistory dir_history;
+  PathCache path_cache;
+  // Above 1, downfinds outside an index walk the tree level by level on
+  // this many threads. Serial until the parallel walk proves faster.
+  size_t downfind_threads = 1;
+  // How many project indexes (and their watchers) stay open at once.
+  size_t max_projects = 2;
+  // Whether open indexes are kept live by an IndexWatcher. Off in batch
+  // shells, which exit long before the watcher's first full scan would pay
+  // for itself; their lookups are validated instead.
+  bool watch_indexes;
+  // Logs every entry visited by downfind to stderr (`tbsh --trace`).
+  bool trace = false;
+  // Reports timings after every line, as if it began with `time`
+  // (`tbsh --time`).
+  bool time_every_line = false;
+
+  // How external commands are started. posix_spawn does not copy the
+  // shell's page tables, which keeps launches cheap as the shell grows.
+  enum class LaunchBackend { Spawn, Fork };
+  LaunchBackend launch_backend = LaunchBackend::Spawn;
+
+  // How upfind probes the ancestors it has no answer for: one at a time,
+  // or all at once through io_uring (or a thread pool where io_uring is not
+  // available). Auto batches only on network and FUSE filesystems; on a
+  // local disk the serial probes are cheaper than a batch that has to cover
+  // every level.
+  enum class UpfindBackend { Auto, Serial, IoUring, Threads };
+  UpfindBackend upfind_backend = UpfindBackend::Auto;
+
+  JobTable jobs;
+
+  // A batch shell runs scripts: it never touches readline, history or the
+  // terminal and does not echo transformed lines.
+  explicit Shell(bool batch = false);
+
+  ~Shell();
+
+  void initialize_readline();
+
+  // History lives in the state directory and is capped at $HISTSIZE lines,
+  // 10000 by default.
+  void initialize_history();
+
+  // SIGCHLD is blocked and read from a signalfd polled next to the terminal.
+  // An interactive shell also moves into its own process group, takes the
+  // terminal, ignores SIGQUIT and the job-control stop signals and reads
+  // SIGINT from interrupt_fd.
+  void initialize_job_control();
+
+  // The signals whose disposition the shell changes and children must not
+  // inherit.
+  static sigset_t child_default_signals();
+
+  static char **custom_completion(const char *text, int start, int end);
+
+  static char *next_match(const char *, int state);
+
+  // Completes `text`, which starts at `start` in the line being edited: the
+  // first word of a pipeline stage completes to builtins and executables on
+  // $PATH, anything else to file names.
+  std::vector<std::string> complete(const std::string &text, int start);
+
+  // Completes a `>pattern` token to the best fuzzy matches in the project
+  // index below the cwd, best first and relative to the cwd.
+  std::vector<std::string> fuzzy_complete(const std::string &text);
+
+  std::vector<std::string> fuzzy_complete_local(const std::string &text,
+                                                const std::string &dir);
+
+  std::string upfind(const std::string &dir_name,
+                     fs::path start = fs::current_path());
+
+  // Breadth-first search below `start` for the first file whose path
+  // relative to `start` ends with `target_pattern`, giving up after `limit`
+  // entries.
+  std::string downfind(const std::string &target_pattern,
+                       fs::path start = fs::current_path(),
+                       size_t limit = 1000);
+
+  static std::runtime_error not_found(const std::string &pattern,
+                                      bool limit_hit);
+
+  // downfind for several patterns in a single walk, which ends once each has
+  // a match or `limit` entries have been seen, and then sets `*limit_hit`.
+  // Directories are read with getdents64 into one buffer and classified by
+  // d_type, with an fstatat only where the filesystem leaves it DT_UNKNOWN;
+  // symlinks are matched like files, never followed. Paths are built in
+  // place in a single buffer holding the absolute path.
+  std::vector<std::optional<std::string>>
+  downfind_all(const std::vector<std::string> &patterns,
+               fs::path start = fs::current_path(), size_t limit = 1000,
+               bool *limit_hit = nullptr);
+
+  // Returns the project enclosing `start` (the directory holding the nearest
+  // `.git`) with its index open, or nullptr outside of any project. Up to
+  // `max_projects` stay open; the least recently used is closed first.
+  Project *index_for(const fs::path &start);
+
+  // Resolves a `>pattern` token through the project index. While the watcher
+  // keeps the index live its answer is final, except for patterns with a
+  // `/`; otherwise hits are checked for existence and misses fall back to a
+  // live downfind. Fuzzy matches are only offered by Tab completion; a
+  // pattern nothing ends in is not found.
+  std::string indexed_downfind(const std::string &target_pattern,
+                               fs::path start = fs::current_path());
+
+  // Where state that outlives a session is kept: $XDG_STATE_HOME/tbsh, or
+  // ~/.local/state/tbsh.
+  static fs::path state_file(const char *name);
+
+  // The path of `dir` relative to the root of `index`, empty at the root.
+  static std::string index_scope(const FileIndex &index, const fs::path &dir);
+
+  void reindex(fs::path start = fs::current_path());
+
+  // Multi-threaded variant of downfind for trees without an index. Rather
+  // than the first entry in walk order it returns the shallowest match, ties
+  // broken by path, and it only checks `limit` between levels of the tree.
+  std::string parallel_downfind(const std::string &target_pattern,
+                                fs::path start = fs::current_path(),
+                                size_t limit = 1000);
+
+  std::vector<std::optional<std::string>>
+  parallel_downfind_all(const std::vector<std::string> &patterns,
+                        fs::path start = fs::current_path(),
+                        size_t limit = 1000, bool *limit_hit = nullptr);
+
+  // Resolves a token typed but not yet submitted, for the prefetcher. Misses
+  // are not worth reporting.
+  std::optional<std::string> speculate(char direction,
+                                       const std::string &pattern,
+                                       const std::string &dir);
+
+  // Resolves one sigil token from `dir`. Throws if nothing is found.
+  std::string resolve_token(char direction, const std::string &pattern,
+                            const std::string &dir);
+
+  // Resolves the tokens of a line from `dir` together: through tbshd, in a
+  // single round trip, when one is running, and in-process otherwise.
+  void resolve_tokens(std::vector<Resolution> &batch,
+                      const std::string &dir);
+
+  // resolve_tokens in-process, with resolve_mutex held. Outside a project
+  // the `>` tokens are all looked for in one walk of the tree. Each batch
+  // is one epoch of the upfind cache.
+  void resolve_tokens_locked(std::vector<Resolution> &batch,
+                             const std::string &dir);
+
+
+  // Hands the prefetcher the sigil tokens of the line being edited: those
+  // the cursor has moved past right away, and the one under the cursor
+  // only once typing pauses (`paused`), since it is probably incomplete.
+  // Returns whether a token is still waiting for that pause.
+  bool prefetch_tokens(bool paused);
+
+  // Replaces each `<pattern` and `>pattern` token of `command` with the path
+  // it resolves to. The result and the scratch space are taken from
+  // `memory`.
+  std::pmr::string
+  transform_command(std::string_view command,
+                    std::pmr::memory_resource *memory =
+                        std::pmr::get_default_resource());
+
+  void set_cwd(std::string path);
+
+  const std::string &current_directory() const { return cwd; }
+
+  // Works out the directory `chdir(path)` just moved to. Paths without `..`
+  // resolve lexically against the tracked cwd; `..` climbs the physical
+  // parent of symlinked directories, so only those ask the kernel.
+  std::string resolve_chdir(const char *path) const;
+
+  bool change_directory(const char *path, bool update_history = true);
+
+  // Starts `argv` as a child process set up as described by `setup` and
+  // returns its pid, or -1 with errno set if it could not be started
+  // (ENOENT when there is no such command). The executable is
+  // resolved through the PATH cache; a cached path that has gone stale is
+  // forgotten and looked up once more. Falls back to fork + execv when
+  // posix_spawn fails for reasons other than the executable itself.
+  pid_t launch(char *const argv[], const ChildSetup &setup = {});
+
+  // Forks and applies `setup` on both sides of the fork. Returns like fork.
+  pid_t fork_child(const ChildSetup &setup);
+
+  static int open_redirect(const char *path, int flags);
+
+  static int output_flags(const CommandLine::Stage &stage);
+
+  bool is_builtin(const std::string &name) const;
+
+  // Whether `stage` runs in the shell (or, in a pipeline, a fork of it)
+  // rather than as an external command.
+  bool runs_in_shell(const CommandLine::Stage &stage) const;
+
+  // Runs a stage runs_in_shell accepted and returns its exit status.
+  int run_builtin(CommandLine::Stage &stage);
+
+  // Runs a builtin in the shell itself, with its redirections applied for
+  // the duration of the call, and returns its exit status. A redirection
+  // that cannot be opened fails the command without running it.
+  int run_builtin_redirected(CommandLine::Stage &stage);
+
+  // Runs a builtin that is part of a pipeline or a background job in a
+  // forked child.
+  pid_t fork_builtin(CommandLine::Stage &stage, const ChildSetup &setup);
+
+  // Starts every stage at once as one job, each connected to the next by a
+  // pipe and to its own redirections. Foreground jobs are waited for, and
+  // `timing`, if given, receives how long starting and waiting took and what
+  // the job used. Returns the exit status of the last stage: 1 if its
+  // redirections failed, 127 if there is no such command and 126 if it
+  // could not be run otherwise, and 0 for a background job.
+  int run_pipeline(std::vector<CommandLine::Stage> &stages,
+                    std::string_view command, bool background,
+                    LineTiming *timing = nullptr);
+
+  // Prints what `time` (or --time) measured for one line to stderr.
+  static void report_timing(const LineTiming &timing);
+
+  // The exit status a shell reports for a wait status.
+  static int exit_status(int status);
+
+  // Waits for the next stage of `job` to change state. Jobs have a process
+  // group of their own only in an interactive shell; otherwise they share
+  // the shell's and their stages are waited for one by one.
+  pid_t wait_stage(JobTable::Job &job, int &status, struct rusage &usage);
+
+  // Sends `sig` to every process of `job`.
+  void signal_job(const JobTable::Job &job, int sig);
+
+  // Waits until `job` finishes or stops and returns the exit status of its
+  // last stage. A foreground job gets the terminal meanwhile and is
+  // forgotten once it finishes; `usage`, if given, receives what its
+  // processes used.
+  int wait_job(JobTable::Job &job, bool foreground,
+               struct rusage *usage = nullptr);
+
+  // Collects the status of every child that changed state, without blocking.
+  void reap_jobs();
+
+  // Consumes the SIGINTs waiting on interrupt_fd and returns whether there
+  // were any.
+  bool take_interrupt();
+
+  JobTable::Job &find_job(std::string_view spec);
+
+  // `fg [%n]`: continues a job in the foreground and waits for it.
+  void foreground_job(std::string_view spec);
+
+  // `bg [%n]`: continues a stopped job in the background.
+  void background_job(std::string_view spec);
+
+  // `wait [%n]`: waits for one job, or for every running job.
+  void wait_jobs(std::string_view spec);
+
+  void add_custom_command(
+      const std::string &name,
+      std::function<void(std::vector<std::string_view> &)> func);
+
+  void add_fast_command(const std::string &name, FastCommand command);
+
+  // `par [-j N] cmd args... ::: items...`: runs the command once per item,
+  // with `{}` in the arguments replaced by the item (or the item appended
+  // when there is no `{}`), at most N at a time. The output of each job is
+  // passed through whole lines at a time so that jobs never interleave
+  // within a line. ^C is passed on to every running job, and the items not
+  // started yet are dropped.
+  void run_parallel(const std::vector<std::string_view> &args);
+
+  const std::string &prompt() const { return prompt_text; }
+
+  // Runs one line of input. Returns false once the shell should exit.
+  bool execute(std::string_view input_line);
+
+  // Readline hands complete lines to this callback from inside run().
+  static void handle_line(char *input);
+
+  // Polls the terminal and the SIGCHLD signalfd together, so background jobs
+  // are reaped and reported while the prompt is waiting for input. Returns
+  // the status to exit with.
+  int run();
+
+  // Runs one script line, skipping blanks and comments. Returns false once
+  // the script should stop.
+  bool execute_script_line(std::string_view line);
+
+  // Runs every line read from `fd` until the input ends or `exit`, and
+  // returns the status to exit with.
+  int run_batch(int fd);
+
+  // Runs the lines of `script` (as given to `tbsh -c`), like run_batch(fd).
+  int run_batch(std::string_view script);
+};
+
+// Registers bk, fw, z, reindex, hash, stats, jobs, fg, bg, wait and par.
+void register_builtins(Shell &shell);
+
+// Registers the in-process pwd, echo, cat, ls and test (and `[`) selected
+// by $TBSH_FAST, colon-separated, all of them by default.
+void register_fast_builtins(Shell &shell);
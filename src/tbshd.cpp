@@ -0,0 +1,221 @@
+// tbshd keeps project indexes, their watchers and the upfind cache warm for
+// every tbsh the user runs. Shells find it through DaemonClient::default_path()
+// and fall back to resolving in-process whenever it is not there.
+#include "tbsh.h"
+
+#include <sys/signalfd.h>
+
+namespace {
+
+std::vector<std::string> split_fields(const std::string &line) {
+  std::vector<std::string> fields;
+  size_t start = 0;
+  for (size_t tab; (tab = line.find('\t', start)) != std::string::npos;
+       start = tab + 1) {
+    fields.push_back(line.substr(start, tab - start));
+  }
+  fields.push_back(line.substr(start));
+  return fields;
+}
+
+// Replies never contain a raw tab or newline, whatever the paths hold.
+std::string sanitize(std::string s) {
+  std::replace(s.begin(), s.end(), '\t', ' ');
+  std::replace(s.begin(), s.end(), '\n', ' ');
+  return s;
+}
+
+std::string format(const Resolution &token) {
+  return (token.found ? "ok\t" : "err\t") + sanitize(token.text) + "\n";
+}
+
+bool is_resolve(const std::vector<std::string> &fields) {
+  return fields[0] == "resolve" && fields.size() == 4 &&
+         fields[1].size() == 1;
+}
+
+// Answers the complete request lines at the front of `buffer` and removes
+// them. Consecutive resolves from the same directory, which is how a shell
+// sends the tokens of one line, are resolved as one batch.
+std::string answer(Shell &shell, std::string &buffer) {
+  std::vector<std::vector<std::string>> requests;
+  size_t start = 0;
+  for (size_t newline; (newline = buffer.find('\n', start)) !=
+                       std::string::npos;
+       start = newline + 1) {
+    requests.push_back(split_fields(buffer.substr(start, newline - start)));
+  }
+  buffer.erase(0, start);
+
+  std::string reply;
+  for (size_t i = 0; i < requests.size();) {
+    const std::vector<std::string> &fields = requests[i];
+    if (is_resolve(fields)) {
+      std::vector<Resolution> batch;
+      for (; i < requests.size() && is_resolve(requests[i]) &&
+             requests[i][2] == fields[2];
+           i++) {
+        batch.push_back({requests[i][1][0], requests[i][3], false, {}});
+      }
+      shell.resolve_tokens(batch, fields[2]);
+      for (auto &token : batch) {
+        reply += format(token);
+      }
+      continue;
+    }
+    if (fields[0] == "complete" && fields.size() == 3) {
+      reply += "ok";
+      for (auto &candidate :
+           shell.fuzzy_complete_local(fields[2], fields[1])) {
+        reply += "\t" + sanitize(candidate);
+      }
+      reply += "\n";
+    } else {
+      reply += "err\tbad request\n";
+    }
+    i++;
+  }
+  return reply;
+}
+
+// Open client connections, so that shutdown can wake and wait for them.
+std::mutex clients_mutex;
+std::condition_variable clients_done;
+std::set<int> client_fds;
+
+void serve(Shell &shell, int fd) {
+  std::string buffer;
+  char chunk[4096];
+  bool open = true;
+  while (open) {
+    ssize_t n = read(fd, chunk, sizeof(chunk));
+    if (n <= 0) {
+      break;
+    }
+    buffer.append(chunk, n);
+    std::string reply = answer(shell, buffer);
+    open = send(fd, reply.data(), reply.size(), MSG_NOSIGNAL) ==
+           static_cast<ssize_t>(reply.size());
+  }
+  std::lock_guard<std::mutex> lock(clients_mutex);
+  client_fds.erase(fd);
+  close(fd);
+  clients_done.notify_all();
+}
+
+// Binds `path`, replacing a socket left behind by a daemon that is gone.
+// Returns -1 if another daemon is already listening there.
+int listen_on(const std::string &path) {
+  struct sockaddr_un addr {};
+  addr.sun_family = AF_UNIX;
+  if (path.size() >= sizeof(addr.sun_path)) {
+    throw std::runtime_error("socket path too long: " + path);
+  }
+  std::memcpy(addr.sun_path, path.c_str(), path.size() + 1);
+  auto *sa = reinterpret_cast<struct sockaddr *>(&addr);
+
+  int probe = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  bool alive = probe >= 0 && connect(probe, sa, sizeof(addr)) == 0;
+  if (probe >= 0) {
+    close(probe);
+  }
+  if (alive) {
+    return -1;
+  }
+  unlink(path.c_str());
+
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  mode_t old_mask = umask(0077);
+  bool bound = fd >= 0 && bind(fd, sa, sizeof(addr)) == 0;
+  umask(old_mask);
+  if (!bound || listen(fd, 64) != 0) {
+    throw std::runtime_error("cannot listen on " + path + ": " +
+                             strerror(errno));
+  }
+  return fd;
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+  bool foreground = false;
+  std::string path = DaemonClient::default_path();
+  for (int i = 1; i < argc; i++) {
+    if (std::strcmp(argv[i], "--foreground") == 0) {
+      foreground = true;
+    } else if (std::strcmp(argv[i], "--socket") == 0 && i + 1 < argc) {
+      path = argv[++i];
+    } else {
+      std::cerr << "Usage: " << argv[0] << " [--foreground] [--socket path]"
+                << std::endl;
+      return EXIT_FAILURE;
+    }
+  }
+
+  int listen_fd;
+  try {
+    listen_fd = listen_on(path);
+  } catch (const std::exception &e) {
+    std::cerr << "tbshd: " << e.what() << std::endl;
+    return EXIT_FAILURE;
+  }
+  if (listen_fd < 0) {
+    std::cerr << "tbshd: already running on " << path << std::endl;
+    return EXIT_FAILURE;
+  }
+  if (!foreground && daemon(0, 0) != 0) {
+    std::cerr << "tbshd: " << strerror(errno) << std::endl;
+    return EXIT_FAILURE;
+  }
+
+  sigset_t stop_signals;
+  sigemptyset(&stop_signals);
+  sigaddset(&stop_signals, SIGTERM);
+  sigaddset(&stop_signals, SIGINT);
+  sigaddset(&stop_signals, SIGHUP);
+  pthread_sigmask(SIG_BLOCK, &stop_signals, nullptr);
+  int stop_fd = signalfd(-1, &stop_signals, SFD_CLOEXEC);
+
+  Shell shell(true);
+  shell.max_projects = 16;
+  shell.watch_indexes = true;
+  register_builtins(shell);
+
+  for (;;) {
+    struct pollfd fds[2] = {{listen_fd, POLLIN, 0}, {stop_fd, POLLIN, 0}};
+    if (poll(fds, 2, -1) < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      break;
+    }
+    if (fds[1].revents) {
+      break;
+    }
+    int client = accept4(listen_fd, nullptr, nullptr, SOCK_CLOEXEC);
+    if (client < 0) {
+      continue;
+    }
+    struct ucred peer;
+    socklen_t length = sizeof(peer);
+    if (getsockopt(client, SOL_SOCKET, SO_PEERCRED, &peer, &length) != 0 ||
+        peer.uid != getuid()) {
+      close(client);
+      continue;
+    }
+    std::lock_guard<std::mutex> lock(clients_mutex);
+    client_fds.insert(client);
+    std::thread(serve, std::ref(shell), client).detach();
+  }
+
+  // Wake every client thread so it exits; the indexes are saved when the
+  // shell is destroyed.
+  close(listen_fd);
+  unlink(path.c_str());
+  std::unique_lock<std::mutex> lock(clients_mutex);
+  for (int fd : client_fds) {
+    shutdown(fd, SHUT_RDWR);
+  }
+  clients_done.wait(lock, [] { return client_fds.empty(); });
+  return 0;
+}
@@ -0,0 +1,404 @@
+#include "tbsh.h"
+
+void StatxBatch::probe(Probe &p) {
+  p.error = statx(AT_FDCWD, p.path.c_str(), 0, mask, &p.st) == 0 ? 0 : errno;
+}
+
+bool StatxBatch::setup_ring() {
+  if (ring_fd >= 0 || !ring_usable) {
+    return ring_usable;
+  }
+  ring_usable = false;
+  struct io_uring_params params {};
+  int fd = syscall(__NR_io_uring_setup, ring_entries, &params);
+  if (fd < 0) {
+    return false;
+  }
+  sq_map_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  cq_map_size =
+      params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+  bool single = params.features & IORING_FEAT_SINGLE_MMAP;
+  if (single) {
+    sq_map_size = cq_map_size = std::max(sq_map_size, cq_map_size);
+  }
+  sq_map = mmap(nullptr, sq_map_size, PROT_READ | PROT_WRITE,
+                MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+  cq_map = single || sq_map == MAP_FAILED
+               ? sq_map
+               : mmap(nullptr, cq_map_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+  void *sqe_map =
+      cq_map == MAP_FAILED
+          ? MAP_FAILED
+          : mmap(nullptr, params.sq_entries * sizeof(io_uring_sqe),
+                 PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd,
+                 IORING_OFF_SQES);
+  if (sqe_map == MAP_FAILED) {
+    unmap_ring();
+    close(fd);
+    return false;
+  }
+  auto *sq = static_cast<char *>(sq_map);
+  auto *cq = static_cast<char *>(cq_map);
+  sq_head = reinterpret_cast<unsigned *>(sq + params.sq_off.head);
+  sq_tail = reinterpret_cast<unsigned *>(sq + params.sq_off.tail);
+  sq_mask = reinterpret_cast<unsigned *>(sq + params.sq_off.ring_mask);
+  sq_array = reinterpret_cast<unsigned *>(sq + params.sq_off.array);
+  cq_head = reinterpret_cast<unsigned *>(cq + params.cq_off.head);
+  cq_tail = reinterpret_cast<unsigned *>(cq + params.cq_off.tail);
+  cq_mask = reinterpret_cast<unsigned *>(cq + params.cq_off.ring_mask);
+  cqes = reinterpret_cast<io_uring_cqe *>(cq + params.cq_off.cqes);
+  sqes = static_cast<io_uring_sqe *>(sqe_map);
+  sq_size = params.sq_entries;
+  ring_fd = fd;
+  ring_usable = true;
+  return true;
+}
+
+void StatxBatch::unmap_ring() {
+  if (sqes) {
+    munmap(sqes, sq_size * sizeof(io_uring_sqe));
+  }
+  if (cq_map && cq_map != MAP_FAILED && cq_map != sq_map) {
+    munmap(cq_map, cq_map_size);
+  }
+  if (sq_map && sq_map != MAP_FAILED) {
+    munmap(sq_map, sq_map_size);
+  }
+}
+
+void StatxBatch::run_on_ring(std::vector<Probe> &probes, size_t first,
+                             size_t last) {
+  unsigned tail = *sq_tail;
+  for (size_t i = first; i < last; i++, tail++) {
+    unsigned slot = tail & *sq_mask;
+    io_uring_sqe &sqe = sqes[slot];
+    std::memset(&sqe, 0, sizeof(sqe));
+    sqe.opcode = IORING_OP_STATX;
+    sqe.fd = AT_FDCWD;
+    sqe.addr = reinterpret_cast<uintptr_t>(probes[i].path.c_str());
+    sqe.len = mask;
+    sqe.off = reinterpret_cast<uintptr_t>(&probes[i].st);
+    sqe.user_data = i;
+    sq_array[slot] = slot;
+  }
+  __atomic_store_n(sq_tail, tail, __ATOMIC_RELEASE);
+
+  unsigned pending = last - first;
+  unsigned unsubmitted = pending;
+  while (pending > 0) {
+    int n = syscall(__NR_io_uring_enter, ring_fd, unsubmitted, 1,
+                    IORING_ENTER_GETEVENTS, nullptr, 0);
+    if (n >= 0) {
+      unsubmitted -= std::min<unsigned>(n, unsubmitted);
+    } else if (errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+      // Entries the kernel took point into `probes` and still have to
+      // complete; the rest are taken back.
+      unsigned taken = __atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+      for (unsigned t = taken; t != tail; t++) {
+        probe(probes[sqes[t & *sq_mask].user_data]);
+        pending--;
+      }
+      __atomic_store_n(sq_tail, taken, __ATOMIC_RELEASE);
+      tail = taken;
+      unsubmitted = 0;
+      ring_usable = false;
+    }
+    unsigned head = *cq_head;
+    for (; head != __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE); head++) {
+      const io_uring_cqe &cqe = cqes[head & *cq_mask];
+      Probe &p = probes[cqe.user_data];
+      if (cqe.res == -EINVAL) {
+        // A kernel without IORING_OP_STATX.
+        probe(p);
+        ring_usable = false;
+      } else {
+        p.error = cqe.res < 0 ? -cqe.res : 0;
+      }
+      pending--;
+    }
+    __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+  }
+}
+
+void StatxBatch::drain() {
+  for (size_t i; (i = next.fetch_add(1)) < work->size();) {
+    probe((*work)[i]);
+  }
+}
+
+void StatxBatch::serve() {
+  uint64_t seen = 0;
+  std::unique_lock<std::mutex> lock(mutex);
+  for (;;) {
+    wake.wait(lock, [&] { return stopping || generation != seen; });
+    if (stopping) {
+      return;
+    }
+    seen = generation;
+    lock.unlock();
+    drain();
+    lock.lock();
+    if (--busy == 0) {
+      done.notify_one();
+    }
+  }
+}
+
+void StatxBatch::run_on_threads(std::vector<Probe> &probes, size_t first) {
+  if (threads.empty()) {
+    for (size_t i = 0; i < pool_size - 1; i++) {
+      threads.emplace_back(&StatxBatch::serve, this);
+    }
+  }
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    work = &probes;
+    next = first;
+    busy = threads.size();
+    generation++;
+  }
+  wake.notify_all();
+  drain();
+  std::unique_lock<std::mutex> lock(mutex);
+  done.wait(lock, [&] { return busy == 0; });
+  work = nullptr;
+}
+
+StatxBatch::~StatxBatch() {
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    stopping = true;
+  }
+  wake.notify_all();
+  for (auto &thread : threads) {
+    thread.join();
+  }
+  if (ring_fd >= 0) {
+    unmap_ring();
+    close(ring_fd);
+  }
+}
+
+void StatxBatch::run(std::vector<Probe> &probes, bool use_ring) {
+  if (probes.size() <= 1) {
+    for (auto &p : probes) {
+      probe(p);
+    }
+    return;
+  }
+  size_t first = 0;
+  if (use_ring && setup_ring()) {
+    for (; first < probes.size() && ring_usable; first += sq_size) {
+      run_on_ring(probes, first, std::min(probes.size(), first + sq_size));
+    }
+  }
+  if (first < probes.size()) {
+    run_on_threads(probes, first);
+  }
+}
+
+std::string UpfindCache::key(std::string_view dir, const std::string &name) {
+  std::string k;
+  k.reserve(dir.size() + 1 + name.size());
+  k += dir;
+  k += '\0';
+  k += name;
+  return k;
+}
+
+std::string UpfindCache::join(std::string_view dir, const std::string &name) {
+  std::string path(dir);
+  if (path != "/") {
+    path += '/';
+  }
+  return path += name;
+}
+
+std::string_view UpfindCache::parent(std::string_view dir) {
+  size_t slash = dir.rfind('/');
+  return slash == 0 ? "/" : dir.substr(0, slash);
+}
+
+bool UpfindCache::has_directory(std::string_view dir, const std::string &name) {
+  std::string k = key(dir, name);
+  auto it = entries.find(k);
+  if (it != entries.end() && it->second.epoch == epoch) {
+    global_stats.count(Stats::Cache::Upfind, true);
+    return it->second.present;
+  }
+
+  struct stat st;
+  if (stat(std::string(dir).c_str(), &st) != 0) {
+    entries.erase(k);
+    return false;
+  }
+  if (it != entries.end() && it->second.mtime.tv_sec == st.st_mtim.tv_sec &&
+      it->second.mtime.tv_nsec == st.st_mtim.tv_nsec) {
+    global_stats.count(Stats::Cache::Upfind, true);
+    it->second.epoch = epoch;
+    return it->second.present;
+  }
+  global_stats.count(Stats::Cache::Upfind, false);
+
+  struct stat candidate;
+  bool present = stat(join(dir, name).c_str(), &candidate) == 0 &&
+                 S_ISDIR(candidate.st_mode);
+  entries[std::move(k)] = {st.st_mtim, present, epoch};
+  return present;
+}
+
+std::optional<std::string>
+UpfindCache::probe_together(std::string_view dir, const std::string &name,
+                            StatxBatch &batch, bool use_ring) {
+  constexpr size_t none = SIZE_MAX;
+  struct Level {
+    std::string_view dir;
+    size_t dir_probe;
+    size_t candidate_probe;
+  };
+  std::vector<Level> levels;
+  std::vector<StatxBatch::Probe> probes;
+  for (;; dir = parent(dir)) {
+    auto it = entries.find(key(dir, name));
+    if (it != entries.end() && it->second.epoch == epoch) {
+      levels.push_back({dir, none, none});
+      if (it->second.present) {
+        break;
+      }
+    } else {
+      levels.push_back({dir, probes.size(), none});
+      probes.push_back({std::string(dir), {}, 0});
+      if (it == entries.end()) {
+        levels.back().candidate_probe = probes.size();
+        probes.push_back({join(dir, name), {}, 0});
+      }
+    }
+    if (is_root(dir)) {
+      break;
+    }
+  }
+  batch.run(probes, use_ring);
+
+  std::optional<std::string> found;
+  for (const Level &level : levels) {
+    std::string k = key(level.dir, name);
+    auto it = entries.find(k);
+    bool present;
+    if (level.dir_probe == none) {
+      global_stats.count(Stats::Cache::Upfind, true);
+      present = it->second.present;
+    } else if (const StatxBatch::Probe &probe = probes[level.dir_probe];
+               probe.error != 0) {
+      if (it != entries.end()) {
+        entries.erase(it);
+      }
+      present = false;
+    } else if (struct timespec mtime = {probe.st.stx_mtime.tv_sec,
+                                        probe.st.stx_mtime.tv_nsec};
+               it != entries.end() &&
+               it->second.mtime.tv_sec == mtime.tv_sec &&
+               it->second.mtime.tv_nsec == mtime.tv_nsec) {
+      global_stats.count(Stats::Cache::Upfind, true);
+      it->second.epoch = epoch;
+      present = it->second.present;
+    } else {
+      global_stats.count(Stats::Cache::Upfind, false);
+      if (level.candidate_probe != none) {
+        const StatxBatch::Probe &candidate = probes[level.candidate_probe];
+        present = candidate.error == 0 && S_ISDIR(candidate.st.stx_mode);
+      } else {
+        // The directory changed since it was cached, which the batch
+        // could not know: probe its candidate now.
+        struct stat candidate;
+        present = stat(join(level.dir, name).c_str(), &candidate) == 0 &&
+                  S_ISDIR(candidate.st_mode);
+      }
+      entries[std::move(k)] = {mtime, present, epoch};
+    }
+    if (present && !found) {
+      found = std::string(level.dir);
+    }
+  }
+  return found;
+}
+
+void UpfindCache::next_epoch() {
+  if (entries.size() > max_entries) {
+    for (auto it = entries.begin(); it != entries.end();) {
+      it = it->second.epoch == epoch ? std::next(it) : entries.erase(it);
+    }
+  }
+  epoch++;
+}
+
+std::optional<std::string>
+UpfindCache::nearest(const std::string &start, const std::string &name,
+                     StatxBatch *batch, bool use_ring) {
+  std::string_view dir = start;
+  for (;; dir = parent(dir)) {
+    auto it = entries.find(key(dir, name));
+    if (it == entries.end() || it->second.epoch != epoch) {
+      break;
+    }
+    global_stats.count(Stats::Cache::Upfind, true);
+    if (it->second.present) {
+      return std::string(dir);
+    }
+    if (is_root(dir)) {
+      return std::nullopt;
+    }
+  }
+  if (batch) {
+    return probe_together(dir, name, *batch, use_ring);
+  }
+  for (;; dir = parent(dir)) {
+    if (has_directory(dir, name)) {
+      return std::string(dir);
+    }
+    if (is_root(dir)) {
+      return std::nullopt;
+    }
+  }
+}
+
+bool UpfindCache::on_remote_filesystem(const std::string &dir) {
+  if (auto it = remote.find(dir); it != remote.end()) {
+    return it->second;
+  }
+  struct statfs fs;
+  bool result = false;
+  if (statfs(dir.c_str(), &fs) == 0) {
+    switch (static_cast<uint32_t>(fs.f_type)) {
+    case 0x6969:     // NFS
+    case 0x65735546: // FUSE
+    case 0xFF534D42: // CIFS
+    case 0xFE534D42: // SMB2
+    case 0x517B:     // SMB
+    case 0x00C36400: // Ceph
+    case 0x01021997: // 9p
+    case 0x5346414F: // AFS
+      result = true;
+    }
+  }
+  if (remote.size() >= 64) {
+    remote.clear();
+  }
+  remote.emplace(dir, result);
+  return result;
+}
+
+void UpfindCache::retain_chain(const std::string &cwd) {
+  for (auto it = entries.begin(); it != entries.end();) {
+    std::string_view dir(it->first.data(), it->first.find('\0'));
+    bool on_chain = cwd.compare(0, dir.size(), dir) == 0 &&
+                    (cwd.size() == dir.size() || dir.back() == '/' ||
+                     cwd[dir.size()] == '/');
+    it = on_chain ? std::next(it) : entries.erase(it);
+  }
+}
+
+void UpfindCache::clear() {
+  entries.clear();
+  remote.clear();
+}